@@ -42,7 +42,7 @@ bc_pgfault(struct UTrapframe *utf)
 	// Allocate a page in the disk map region and read the
 	// contents of the block from the disk into that page.
 	//
-	sys_page_alloc(env->env_id, ROUNDDOWN(addr, PGSIZE), PTE_USER);
+	sys_page_alloc(thisenv->env_id, ROUNDDOWN(addr, PGSIZE), PTE_USER);
 	ide_read(blockno * BLKSECTS, addr, BLKSECTS);
 
 	// Sanity check the block number. (exercise for the reader:
@@ -74,8 +74,8 @@ flush_block(void *addr)
 		return;
 
 	ide_write(blockno * BLKSECTS, addr, BLKSECTS);
-	sys_page_map(env->env_id, ROUNDDOWN(addr, PGSIZE),
-		env->env_id, ROUNDDOWN(addr, PGSIZE),
+	sys_page_map(thisenv->env_id, ROUNDDOWN(addr, PGSIZE),
+		thisenv->env_id, ROUNDDOWN(addr, PGSIZE),
 		PTE_USER);
 }
 
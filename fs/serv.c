@@ -48,6 +48,11 @@ struct OpenFile opentab[MAXOPEN] = {
 // Virtual address at which to receive page mappings containing client requests.
 union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
 
+// serve() receives a batch of up to FS_BATCH requests at once, the i'th
+// into the page FSREQ_SLOT(i), counting down from fsreq.
+#define FS_BATCH	8
+#define FSREQ_SLOT(i)	((union Fsipc *) ((uintptr_t) fsreq - (i) * PGSIZE))
+
 void
 serve_init(void)
 {
@@ -310,6 +315,45 @@ serve_remove(envid_t envid, struct Fsreq_remove *req)
 	return file_remove(path);
 }
 
+// Share the block of req->req_fileid that starts at byte req->req_offset
+// with the caller, read-only, storing the block cache page and its
+// permissions in *pg_store and *perm_store as for serve_open.  Our own
+// mapping of the block becomes copy-on-write, so that a later write to
+// it gives us a new page and the clients keep seeing what they mapped.
+int
+serve_map(envid_t envid, struct Fsreq_map *req,
+	  void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_WRONLY
+	    || req->req_offset < 0 || req->req_offset % BLKSIZE != 0
+	    || req->req_offset >= o->o_file->f_size)
+		return -E_INVAL;
+	if ((r = file_get_block(o->o_file, req->req_offset / BLKSIZE, &blk)) < 0)
+		return r;
+
+	// Fault the block in, so that there is a page to send.  Write it
+	// back if it is dirty, since remapping it clears PTE_D.
+	if (!va_is_mapped(blk))
+		(void) *(volatile char *) blk;
+	if (vpt[VPN(blk)] & PTE_W) {
+		flush_block(blk);
+		if ((r = sys_page_map(0, blk, 0, blk, PTE_P|PTE_U|PTE_COW)) < 0)
+			return r;
+	}
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U;
+	return 0;
+}
+
 // Sync the file system.
 int
 serve_sync(envid_t envid, union Fsipc *req)
@@ -321,8 +365,9 @@ serve_sync(envid_t envid, union Fsipc *req)
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open and map are handled specially because they pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
+	/* [FSREQ_MAP] =	(fshandler)serve_map, */
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
@@ -333,38 +378,77 @@ fshandler handlers[] = {
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// Handle one request, whose argument page (if any) was received at req.
+// Only the reply to the last request of a batch hands the client the CPU.
+static void
+serve_req(uint32_t reqno, envid_t whom, union Fsipc *req, int perm, bool last)
+{
+	void *pg;
+	int r;
+
+	if (debug)
+		cprintf("fs req %d from %08x [page %08x: %s]\n",
+			reqno, whom, vpt[VPN(req)], req);
+
+	// All requests must contain an argument page
+	if (!(perm & PTE_P)) {
+		cprintf("Invalid request from %08x: no argument page\n",
+			whom);
+		return; // just leave it hanging...
+	}
+
+	pg = NULL;
+	if (reqno == FSREQ_OPEN) {
+		r = serve_open(whom, (struct Fsreq_open*)req, &pg, &perm);
+	} else if (reqno == FSREQ_MAP) {
+		r = serve_map(whom, &req->map, &pg, &perm);
+	} else if (reqno < NHANDLERS && handlers[reqno]) {
+		r = handlers[reqno](whom, req);
+	} else {
+		cprintf("Invalid request code %d from %08x\n", whom, reqno);
+		r = -E_INVAL;
+	}
+	if (last)
+		ipc_send(whom, r, pg, perm);
+	else
+		ipc_reply(whom, r, pg, perm);
+	sys_page_unmap(0, req);
+}
+
 void
 serve(void)
 {
-	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	struct Ipc_msg msgs[FS_BATCH];
+	uint32_t ntraps = 0, nreqs = 0;
+	int i, n, r;
+
+	// Clients block on us, so don't make them wait behind batch jobs.
+	if ((r = sys_env_set_priority(0, ENV_PRIO_MAX)) < 0)
+		panic("sys_env_set_priority: %e", r);
+
+	// Keep the file server (and its block cache) on one CPU, away
+	// from CPU 0 and its device interrupts if there is another CPU.
+	if ((r = sys_env_set_affinity(0, 1 << 1)) < 0 && r != -E_INVAL)
+		panic("sys_env_set_affinity: %e", r);
 
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		// Take all queued requests, up to FS_BATCH, in one trap.
+		for (i = 0; i < FS_BATCH; i++)
+			msgs[i].im_dstva = FSREQ_SLOT(i);
+		if ((n = ipc_recv_batch(msgs, FS_BATCH)) < 0)
+			panic("ipc_recv_batch: %e", n);
+
+		ntraps++;
+		nreqs += n;
 		if (debug)
-			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, vpt[VPN(fsreq)], fsreq);
-
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
-			cprintf("Invalid request from %08x: no argument page\n",
-				whom);
-			continue; // just leave it hanging...
-		}
-
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", whom, req);
-			r = -E_INVAL;
-		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+			cprintf("fs: %d reqs, %d.%02d reqs per trap\n", n,
+				nreqs / ntraps, (nreqs * 100 / ntraps) % 100);
+
+		// Reply to all but the last request without giving up the
+		// CPU, so the rest of the batch isn't left waiting.
+		for (i = 0; i < n; i++)
+			serve_req(msgs[i].im_value, msgs[i].im_from,
+				  FSREQ_SLOT(i), msgs[i].im_perm, i == n - 1);
 	}
 }
 
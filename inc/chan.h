@@ -0,0 +1,53 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_INC_CHAN_H
+#define JOS_INC_CHAN_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// Channels: asynchronous shared-memory IPC between two environments.
+//
+// A channel is a pair of pages shared by its two ends.  Each page holds
+// one single-producer/single-consumer ring, so every end sends on one
+// ring and receives on the other.  The creator of the channel sees
+// [ring 0, ring 1] mapped at [va, va+PGSIZE); the peer that attaches to
+// it sees them swapped, so at both ends va is the send ring and
+// va+PGSIZE the receive ring.
+//
+// Messages are copied in and out of the rings without trapping.  The
+// only system calls are sys_chan_wait(), when a consumer finds its ring
+// empty or a producer finds it full and wants to sleep, and
+// sys_chan_notify(), when the other end finds that it went to sleep.
+//
+// The kernel allocates channels as they are created, so their number
+// is only limited by memory: sys_chan_create() returns -E_NO_MEM once
+// there is none left for the channel or its two ring pages.
+
+#define CHAN_MSGSIZE	64		// Bytes per message (one cache line)
+#define CHAN_NSLOT	32		// Messages per ring; a power of 2
+
+// What sys_chan_wait() waits for.
+#define CHAN_WAIT_RECV	0		// A message in the receive ring
+#define CHAN_WAIT_SEND	1		// Room in the send ring
+
+struct Chan_msg {
+	uint32_t cm_type;		// Message type, defined by the user
+	uint32_t cm_len;		// Number of valid bytes in cm_data
+	uint8_t cm_data[CHAN_MSGSIZE - 8];
+};
+
+struct Chan_ring {
+	// cr_tail is only written by the producer and cr_head only by the
+	// consumer.  Both run freely and are reduced mod CHAN_NSLOT to
+	// index cr_msgs; the ring is empty iff they are equal.
+	volatile uint32_t cr_tail;	// Next slot the producer fills
+	volatile uint32_t cr_blocked;	// Producer is (about to be) asleep
+	uint8_t cr_pad0[CHAN_MSGSIZE - 8];
+	volatile uint32_t cr_head;	// Next slot the consumer drains
+	volatile uint32_t cr_sleeping;	// Consumer is (about to be) asleep
+	uint8_t cr_pad1[CHAN_MSGSIZE - 8];
+	struct Chan_msg cr_msgs[CHAN_NSLOT];
+};
+
+#endif	// !JOS_INC_CHAN_H
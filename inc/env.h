@@ -12,21 +12,24 @@ typedef int32_t envid_t;
 
 // An environment ID 'envid_t' has three parts:
 //
-// +1+---------------21-----------------+--------10--------+
-// |0|          Uniqueifier             |   Environment    |
-// | |                                  |      Index       |
-// +------------------------------------+------------------+
-//                                       \--- ENVX(eid) --/
+// +1+-------------17-------------+-----------14-----------+
+// |0|        Uniqueifier         |      Environment       |
+// | |                            |         Index          |
+// +------------------------------+------------------------+
+//                                 \----- ENVX(eid) -----/
 //
 // The environment index ENVX(eid) equals the environment's offset in the
 // 'envs[]' array.  The uniqueifier distinguishes environments that were
 // created at different times, but share the same environment index.
 //
+// envs[] has room for NENV environments, but only the first pages of it,
+// enough for the environments created so far, are actually mapped.
+//
 // All real environments are greater than 0 (so the sign bit is zero).
 // envid_ts less than 0 signify errors.  The envid_t == 0 is special, and
 // stands for the current environment.
 
-#define LOG2NENV		10
+#define LOG2NENV		14
 #define NENV			(1 << LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
 
@@ -34,6 +37,42 @@ typedef int32_t envid_t;
 #define ENV_FREE		0
 #define ENV_RUNNABLE		1
 #define ENV_NOT_RUNNABLE	2
+#define ENV_DYING		3
+
+// Scheduling priorities.  Runnable environments with a higher env_priority
+// always run before those with a lower one; equal priorities round-robin.
+#define NPRIO			8
+#define ENV_PRIO_MIN		0
+#define ENV_PRIO_DEFAULT	3
+#define ENV_PRIO_MAX		(NPRIO - 1)
+
+// Default time slice, in timer ticks.  The timer interrupt only
+// preempts an environment once it has used up its whole slice.
+#define ENV_SLICE_DEFAULT	2
+
+// Default CPU affinity: bit i of env_affinity is set if the env may run
+// on CPU i.
+#define ENV_AFFINITY_ANY	0xffffffff
+
+// One message received by sys_ipc_recv_batch.
+#define IPC_BATCH_MAX		32	// Most messages per call
+struct Ipc_msg {
+	void *im_dstva;			// In: va at which to map its page
+	envid_t im_from;		// Out: envid of the sender
+	uint32_t im_value;		// Out: data value sent
+	int im_perm;			// Out: perm of page mapping received
+};
+
+// A demand-zero region of an env's address space, set up with
+// sys_vm_reserve.  The first touch of a page in it that has nothing
+// mapped maps a fresh zeroed page with vr_perm, without an upcall.
+// The kernel keeps an env's regions on its env_vmareas list, and
+// sys_vm_regions copies them out.
+struct Vm_region {
+	uintptr_t vr_start;		// First address, page-aligned
+	size_t vr_len;			// Length in bytes, 0 if unused
+	int vr_perm;			// Permissions of the pages
+};
 
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
@@ -42,10 +81,25 @@ struct Env {
 	envid_t env_parent_id;		// env_id of this env's parent
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
+	int env_cpunum;			// The CPU that the env last ran on
+
+	// Scheduling
+	uint32_t env_priority;		// Run queue this env is placed on
+	TAILQ_ENTRY(Env) env_sched_link; // Run queue link pointers
+	uint32_t env_slice;		// Time slice length, in ticks
+	uint32_t env_slice_left;	// Ticks left before preemption
+	uint32_t env_affinity;		// Bitmask of CPUs env may run on
+	int env_runq_cpu;		// CPU whose run queue env is on
+
+	// CPU accounting, in cycles as counted by rdtsc
+	uint64_t env_tsc;		// Time stamp of last user/kernel switch
+	uint64_t env_utime;		// Cycles spent in user mode
+	uint64_t env_ktime;		// Cycles spent in the kernel
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 	physaddr_t env_cr3;		// Physical address of page dir
+	LIST_HEAD(Vm_area_list, Vm_area) env_vmareas; // Demand-zero regions
 
 	// Exception handling
 	void *env_pgfault_upcall;	// page fault upcall entry point
@@ -56,6 +110,25 @@ struct Env {
 	uint32_t env_ipc_value;		// data value sent to us 
 	envid_t env_ipc_from;		// envid of the sender	
 	int env_ipc_perm;		// perm of page mapping received
+	struct Ipc_msg *env_ipc_batch;	// msgs of a blocked sys_ipc_recv_batch
+
+	// Blocking IPC send.  Senders that find us not receiving wait on
+	// env_ipc_senders in FIFO order, with their message kept in their
+	// own env_ipc_send_* fields until we receive it.
+	TAILQ_HEAD(Env_ipc_senders, Env) env_ipc_senders;
+	TAILQ_ENTRY(Env) env_ipc_link;	// Link on receiver's env_ipc_senders
+	envid_t env_ipc_send_to;	// envid we are blocked sending to
+	uint32_t env_ipc_send_value;	// value we are sending
+	void *env_ipc_send_srcva;	// va of page we are sending
+	int env_ipc_send_perm;		// perm of page we are sending
+	bool env_ipc_call;		// receive the reply once sent (ipc_call)
+
+	// Channels (see inc/chan.h)
+	int env_chan_wait;		// Channel we sleep on in chan_wait, or -1
+
+	// Timed sleeps (see kern/time.c)
+	uint32_t env_wakeup_tick;	// Tick to wake up at, while on the wheel
+	LIST_ENTRY(Env) env_timer_link;	// Link on a timer wheel slot
 };
 
 #endif // !JOS_INC_ENV_H
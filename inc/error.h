@@ -25,6 +25,8 @@
 #define E_NOT_EXEC	14	// File not a valid executable
 #define E_NOT_SUPP	15	// Operation not supported
 
-#define MAXERROR	15
+#define E_TIMEOUT	16	// Deadline passed before the event happened
+
+#define MAXERROR	16
 
 #endif	// !JOS_INC_ERROR_H */
@@ -18,18 +18,25 @@
 #include <inc/syscall.h>
 #include <inc/trap.h>
 #include <inc/fs.h>
+#include <inc/chan.h>
 #include <inc/fd.h>
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/time.h>
 
 #define USED(x)		(void)(x)
 
 // libos.c or entry.S
 extern char *binaryname;
-extern volatile struct Env *env;
+// Our own Env.  Threads made by sfork() share all global variables but
+// not their stacks, so each one keeps this pointer in the top word of
+// its stack, which entry.S and spawn leave free for it.
+#define USTACKENV	(USTACKTOP - 4)
+#define thisenv		(*(volatile struct Env **) USTACKENV)
 extern volatile struct Env envs[NENV];
 extern volatile struct Page pages[];
+extern volatile struct Timepage timepage;
 void	exit(void);
 
 // pgfault.c
@@ -45,17 +52,40 @@ envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
+envid_t	sys_fork_cow(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int	sys_env_set_priority(envid_t env, uint32_t prio);
+int	sys_env_set_slice(envid_t env, uint32_t ticks);
+int	sys_env_set_affinity(envid_t env, uint32_t cpumask);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_alloc_range(envid_t env, void *va, size_t npages, int perm);
+int	sys_page_map_range(envid_t src_env, void *src_va,
+			   envid_t dst_env, void *dst_va, size_t npages, int perm);
+int	sys_page_unmap_range(envid_t env, void *va, size_t npages);
+int	sys_pt_share(envid_t env, void *va);
+int	sys_vm_reserve(envid_t env, void *va, size_t len, int perm);
+int	sys_vm_regions(struct Vm_region *vrs, size_t skip, size_t n);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_send_switch(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_recv_batch(struct Ipc_msg *msgs, int n);
+int	sys_chan_create(envid_t peer, void *va);
+int	sys_chan_attach(int id, void *va);
+int	sys_chan_notify(int id);
+int	sys_chan_wait(int id, int what);
 unsigned int sys_uptime();
 unsigned int sys_time_msec(void);
+int	sys_sleep_until(unsigned int msec);
+int	sys_ipc_recv_until(void *rcv_pg, unsigned int msec);
+int	sys_time_nsec(uint64_t *nsec);
 int sys_transmit(void *buffer, size_t len);
 int sys_receive(void *buffer);
 
@@ -73,14 +103,38 @@ sys_exofork(void)
 	return ret;
 }
 
+// time.c
+void	timepage_read(struct Timepage *tp);
+uint64_t time_nsec(void);
+unsigned int time_msec(void);
+
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+void	ipc_reply(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_until(envid_t *from_env_store, void *pg, int *perm_store,
+		       unsigned int msec);
+int	ipc_recv_batch(struct Ipc_msg *msgs, int n);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+
+// chan.c
+struct Chan {
+	int ch_id;			// Channel id, for the system calls
+	struct Chan_ring *ch_tx;	// Ring we send on
+	struct Chan_ring *ch_rx;	// Ring we receive from
+};
+
+int	chan_create(envid_t peer, void *va, struct Chan *ch);
+int	chan_attach(int id, void *va, struct Chan *ch);
+int	chan_send(struct Chan *ch, const struct Chan_msg *m);
+int	chan_poll(struct Chan *ch, struct Chan_msg *msgs, int n);
+int	chan_recv(struct Chan *ch, struct Chan_msg *msgs, int n);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
-envid_t	sfork(void);	// Challenge!
+envid_t	ufork(void);
+envid_t	sfork(void);
 
 // fd.c
 int	close(int fd);
@@ -96,6 +150,7 @@ int	stat(const char *path, struct Stat *statbuf);
 // file.c
 int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
+int	read_map(int fd, off_t offset, void *va);
 int	remove(const char *path);
 int	sync(void);
 
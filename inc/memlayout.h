@@ -17,7 +17,7 @@
 #define GD_KD     0x10     // kernel data
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
-#define GD_TSS    0x28     // Task segment selector
+#define GD_TSS0   0x28     // Task segment selector for CPU 0
 
 /*
  * Virtual memory map:                                Permissions
@@ -36,22 +36,35 @@
  *    KERNBASE ----->  +------------------------------+ 0xf0000000
  *                     |  Cur. Page Table (Kern. RW)  | RW/--  PTSIZE
  *    VPT,KSTACKTOP--> +------------------------------+ 0xefc00000      --+
- *                     |         Kernel Stack         | RW/--  KSTKSIZE   |
+ *                     |     CPU0's Kernel Stack      | RW/--  KSTKSIZE   |
+ *                     | - - - - - - - - - - - - - - -|                   |
+ *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
+ *                     +------------------------------+                   |
+ *                     |     CPU1's Kernel Stack      | RW/--  KSTKSIZE   |
  *                     | - - - - - - - - - - - - - - -|                 PTSIZE
- *                     |      Invalid Memory (*)      | --/--             |
- *    ULIM     ------> +------------------------------+ 0xef800000      --+
+ *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
+ *                     +------------------------------+                   |
+ *                     :              .               :                   |
+ *                     :              .               :                   |
+ *    MMIOLIM ------>  +------------------------------+ 0xef800000      --+
+ *                     |       Memory-mapped I/O      | RW/--  PTSIZE
+ *    MMIOBASE ----->  +------------------------------+ 0xef400000
+ *                     |     Kernel ENVS (growable)   | RW/--  PTSIZE
+ *    ULIM, KENVS -->  +------------------------------+ 0xef000000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
- *    UVPT      ---->  +------------------------------+ 0xef400000
+ *    UVPT      ---->  +------------------------------+ 0xeec00000
  *                     |          RO PAGES            | R-/R-  PTSIZE
- *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
- * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
+ *    UPAGES    ---->  +------------------------------+ 0xee800000
+ *                     |      RO ENVS (growable)      | R-/R-  PTSIZE
+ *    UENVS     ---->  +------------------------------+ 0xee400000
+ *                     |      RO TIME (one page)      | R-/R-  PTSIZE
+ * UTOP,UTIME ------>  +------------------------------+ 0xee000000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebff000
+ *                     +------------------------------+ 0xedfff000
  *                     |       Empty Memory (*)       | --/--  PGSIZE
- *    USTACKTOP  --->  +------------------------------+ 0xeebfe000
+ *    USTACKTOP  --->  +------------------------------+ 0xedffe000
  *                     |      Normal User Stack       | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebfd000
+ *                     +------------------------------+ 0xedffd000
  *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -94,7 +107,18 @@
 #define VPT		(KERNBASE - PTSIZE)
 #define KSTACKTOP	VPT
 #define KSTKSIZE	(8*PGSIZE)   		// size of a kernel stack
-#define ULIM		(KSTACKTOP - PTSIZE) 
+#define KSTKGAP		(8*PGSIZE)   		// size of a kernel stack guard
+
+// Memory-mapped IO, such as the local APIC.
+#define MMIOLIM		(KSTACKTOP - PTSIZE)
+#define MMIOBASE	(MMIOLIM - PTSIZE)
+
+// The kernel's writable view of the envs[] array.  Only the part of it
+// that is in use is mapped; env_alloc() maps more a page at a time, in
+// step with the read-only view at UENVS.
+#define KENVS		(MMIOBASE - PTSIZE)
+
+#define ULIM		(KENVS)
 
 /*
  * User read-only mappings! Anything below here til UTOP are readonly to user.
@@ -107,13 +131,16 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// The kernel's clock (struct Timepage, see inc/time.h), in the first
+// page of this slot
+#define UTIME		(UENVS - PTSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
  */
 
 // Top of user-accessible VM
-#define UTOP		UENVS
+#define UTOP		UTIME
 // Top of one-page user exception stack
 #define UXSTACKTOP	UTOP
 // Next page left invalid to guard against exception stack overflow; then:
@@ -131,6 +158,9 @@
 // The location of the user-level STABS data structure
 #define USTABDATA	(PTSIZE / 2)	
 
+// Physical address of the AP bootstrap code (see kern/mpentry.S).
+#define MPENTRY_PADDR	0x7000
+
 
 #ifndef __ASSEMBLER__
 
@@ -175,6 +205,12 @@ struct Page {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy allocator state.  A block of 2^pp_order pages is described
+	// by its first page; pp_free is set if the block is on a free list.
+	// Both are 0 in the other pages of a block.
+	uint8_t pp_order;
+	uint8_t pp_free;
 };
 
 #endif /* !__ASSEMBLER__ */
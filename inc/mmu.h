@@ -65,12 +65,20 @@
 #define PTE_A		0x020	// Accessed
 #define PTE_D		0x040	// Dirty
 #define PTE_PS		0x080	// Page Size
-#define PTE_MBZ		0x180	// Bits must be zero
+#define PTE_G		0x100	// Global
 
 // The PTE_AVAIL bits aren't used by the kernel or interpreted by the
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// PTE_COW marks copy-on-write page table entries.  It is one of the
+// PTE_AVAIL bits, but the kernel resolves write faults on such pages.
+#define PTE_COW		0x800
+
+// PTE_SHARE marks pages that fork() shares with the child as they are,
+// instead of making them copy-on-write.  It is one of the PTE_AVAIL bits.
+#define PTE_SHARE	0x400
+
 // Only flags in PTE_USER may be used in system calls.
 #define PTE_USER	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -91,6 +99,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
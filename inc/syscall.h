@@ -18,9 +18,30 @@ enum
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_ipc_send_switch,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_recv_batch,
 	SYS_time_msec,
 	SYS_transmit,
 	SYS_receive,
+	SYS_env_set_priority,
+	SYS_env_set_slice,
+	SYS_env_set_affinity,
+	SYS_chan_create,
+	SYS_chan_attach,
+	SYS_chan_notify,
+	SYS_chan_wait,
+	SYS_page_alloc_range,
+	SYS_page_map_range,
+	SYS_page_unmap_range,
+	SYS_fork_cow,
+	SYS_pt_share,
+	SYS_vm_reserve,
+	SYS_vm_regions,
+	SYS_sleep_until,
+	SYS_ipc_recv_until,
+	SYS_time_nsec,
 	NSYSCALLS
 };
 
@@ -0,0 +1,49 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_INC_TIME_H
+#define JOS_INC_TIME_H
+
+#include <inc/types.h>
+
+// The kernel's clock, which it keeps up to date on every timer tick in
+// a page mapped read-only at UTIME in every environment.  User code
+// reads the time from it without a system call (see lib/time.c).
+//
+// tp_seq makes the page a sequence lock: the kernel makes it odd while
+// it updates the page and even again after, so a reader that sees the
+// same even tp_seq before and after reading has a consistent copy.
+//
+// The nanosecond clock is tp_nsec at the last tick, plus the TSC cycles
+// since then scaled by tp_tsc_mult / 2^TIMEPAGE_TSC_SHIFT; see
+// timepage_nsec().  The kernel measures the TSC frequency against the
+// PIT at boot.  If it cannot, tp_tsc_mult is 0 and the clock only
+// advances 10 ms at a time with the ticks.
+struct Timepage {
+	uint32_t tp_seq;		// Odd while the kernel is updating
+	uint32_t tp_ticks;		// Timer ticks since boot
+	uint32_t tp_msec;		// Milliseconds since boot, as time_msec()
+	uint32_t tp_tsc_mult;		// Nanoseconds per cycle, fixed point
+	uint64_t tp_tsc;		// TSC at the last tick
+	uint64_t tp_tsc_per_msec;	// TSC frequency, or 0 if unknown
+	uint64_t tp_nsec;		// Nanoseconds since boot at the last tick
+};
+
+// The shift keeps tp_tsc_mult precise to a few parts per million, and
+// (cycles * tp_tsc_mult) from overflowing for over an hour's worth of
+// cycles since the last tick.
+#define TIMEPAGE_TSC_SHIFT	22
+
+// Return the nanoseconds since boot at the time the TSC read 'tsc',
+// according to tp, a consistent copy of the time page.  A TSC that
+// reads a little behind the one that took the last tick, on another
+// CPU, counts as the time of that tick, so the clock never goes back.
+static __inline uint64_t
+timepage_nsec(const struct Timepage *tp, uint64_t tsc)
+{
+	if (tp->tp_tsc_mult == 0 || tsc < tp->tp_tsc)
+		return tp->tp_nsec;
+	return tp->tp_nsec
+		+ (((tsc - tp->tp_tsc) * tp->tp_tsc_mult) >> TIMEPAGE_TSC_SHIFT);
+}
+
+#endif /* !JOS_INC_TIME_H */
@@ -3,6 +3,15 @@
 
 #include <inc/types.h>
 
+// Feature flags returned in %edx by cpuid(1, ...)
+#define CPUID_FEAT_SEP	0x00000800	// SYSENTER and SYSEXIT
+#define CPUID_FEAT_PGE	0x00002000	// Global pages (PTE_G, CR4_PGE)
+
+// Model-specific registers
+#define MSR_SYSENTER_CS		0x174	// Kernel %cs for sysenter
+#define MSR_SYSENTER_ESP	0x175	// Kernel %esp for sysenter
+#define MSR_SYSENTER_EIP	0x176	// Kernel entry point for sysenter
+
 static __inline void breakpoint(void) __attribute__((always_inline));
 static __inline uint8_t inb(int port) __attribute__((always_inline));
 static __inline void insb(int port, void *addr, int cnt) __attribute__((always_inline));
@@ -34,6 +43,8 @@ static __inline uint32_t read_ebp(void) __attribute__((always_inline));
 static __inline uint32_t read_esp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline void wrmsr(uint32_t msr, uint64_t val) __attribute__((always_inline));
+static __inline uint32_t xchg(volatile uint32_t *addr, uint32_t newval) __attribute__((always_inline));
 
 static __inline void
 breakpoint(void)
@@ -274,4 +285,23 @@ read_tsc(void)
         return tsc;
 }
 
+static __inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	__asm __volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+static __inline uint32_t
+xchg(volatile uint32_t *addr, uint32_t newval)
+{
+	uint32_t result;
+
+	// The + in "+m" denotes a read-modify-write operand.
+	asm volatile("lock; xchgl %0, %1" :
+			 "+m" (*addr), "=a" (result) :
+			 "1" (newval) :
+			 "cc");
+	return result;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -0,0 +1,281 @@
+// Kernel side of shared-memory channels.  See inc/chan.h.
+//
+// The kernel only allocates and maps the ring pages and puts consumers
+// and producers to sleep and wakes them up again; it never copies
+// messages.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+
+#include <kern/chan.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/kmalloc.h>
+
+// End 0 of a channel is its creator and end 1 the peer named when it
+// was created.  End i sends on ch_ring[i].
+struct Chanent {
+	int ch_id;			// id handed out to user space
+	envid_t ch_env[2];		// envids of the two ends, 0 once gone
+	bool ch_live[2];		// end has the rings mapped
+	struct Page *ch_ring[2];	// the ring pages; we hold a ref on each
+	LIST_ENTRY(Chanent) ch_link;	// link on chans
+};
+
+// Channels are allocated from chan_cache as they are created, so there
+// is no fixed limit on how many there are.  Ids count up from 0 and
+// are never shared by two live channels.
+static struct Kmem_cache *chan_cache;
+static LIST_HEAD(Chanent_list, Chanent) chans;
+static int chan_next_id;
+
+// The rings must stay shared when either end forks.
+#define CHAN_PERM	(PTE_P|PTE_U|PTE_W|PTE_SHARE)
+
+// Check that two pages fit at va below UTOP.
+static int
+chan_check_va(void *va)
+{
+	if (PGOFF(va) || (uintptr_t) va > UTOP - 2 * PGSIZE)
+		return -E_INVAL;
+	return 0;
+}
+
+// Map ch's rings at [va, va + 2*PGSIZE) in curenv as seen from 'end':
+// its send ring first, then its receive ring.
+static int
+chan_map(struct Chanent *ch, int end, void *va)
+{
+	int r;
+
+	if ((r = page_insert(curenv->env_pgdir, ch->ch_ring[end], va, CHAN_PERM)) < 0)
+		return r;
+	if ((r = page_insert(curenv->env_pgdir, ch->ch_ring[!end],
+			     va + PGSIZE, CHAN_PERM)) < 0) {
+		page_remove(curenv->env_pgdir, va);
+		return r;
+	}
+	return 0;
+}
+
+// Return channel 'id', or NULL if there is none.
+static struct Chanent *
+chan_find(int id)
+{
+	struct Chanent *ch;
+
+	LIST_FOREACH(ch, &chans, ch_link)
+		if (ch->ch_id == id)
+			return ch;
+	return NULL;
+}
+
+// Find channel 'id' and which end of it curenv holds.
+static int
+chan_lookup(int id, struct Chanent **ch_store, int *end_store)
+{
+	struct Chanent *ch;
+	int end;
+
+	if ((ch = chan_find(id)) == NULL)
+		return -E_INVAL;
+	for (end = 0; end < 2; end++)
+		if (ch->ch_live[end] && ch->ch_env[end] == curenv->env_id) {
+			*ch_store = ch;
+			*end_store = end;
+			return 0;
+		}
+	return -E_INVAL;
+}
+
+// Return the env at the other end of ch from 'end', or NULL if it has
+// gone away.
+static struct Env *
+chan_peer(struct Chanent *ch, int end)
+{
+	struct Env *e;
+
+	if (ch->ch_env[!end] == 0 || envid2env(ch->ch_env[!end], &e, 0) < 0)
+		return NULL;
+	return e;
+}
+
+// Create a channel between curenv and 'peer', mapping its rings at
+// [va, va + 2*PGSIZE) in curenv.  The peer maps them with chan_attach().
+//
+// Returns the channel id on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if peer doesn't currently exist.
+//	-E_INVAL if peer is curenv, or va is not page-aligned or the two
+//		pages do not fit below UTOP.
+//	-E_NO_MEM if there is not enough memory.
+int
+chan_create(envid_t peer, void *va)
+{
+	struct Chanent *ch;
+	struct Env *e;
+	int i, r;
+
+	if ((r = chan_check_va(va)) < 0)
+		return r;
+	if ((r = envid2env(peer, &e, 0)) < 0)
+		return r;
+	if (e == curenv)
+		return -E_INVAL;
+
+	if (!chan_cache
+	    && !(chan_cache = kmem_cache_create("chan",
+						sizeof(struct Chanent), NULL)))
+		return -E_NO_MEM;
+	if ((ch = kmem_cache_alloc(chan_cache)) == NULL)
+		return -E_NO_MEM;
+
+	for (i = 0; i < 2; i++) {
+		if ((r = page_alloc_zeroed(&ch->ch_ring[i])) < 0)
+			goto fail;
+		ch->ch_ring[i]->pp_ref++;
+	}
+	if ((r = chan_map(ch, 0, va)) < 0)
+		goto fail;
+
+	do {
+		ch->ch_id = chan_next_id;
+		chan_next_id = (chan_next_id + 1) & 0x7fffffff;
+	} while (chan_find(ch->ch_id) != NULL);
+	ch->ch_env[0] = curenv->env_id;
+	ch->ch_env[1] = e->env_id;
+	ch->ch_live[0] = 1;
+	ch->ch_live[1] = 0;
+	LIST_INSERT_HEAD(&chans, ch, ch_link);
+	return ch->ch_id;
+
+fail:
+	while (i-- > 0)
+		page_decref(ch->ch_ring[i]);
+	kmem_cache_free(chan_cache, ch);
+	return r;
+}
+
+// Map the rings of channel 'id', which must have been created with
+// curenv as its peer, at [va, va + 2*PGSIZE) in curenv.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if there is no channel 'id' for curenv to attach to, or
+//		va is bad as for chan_create().
+//	-E_NO_MEM if there is not enough memory to map the rings.
+int
+chan_attach(int id, void *va)
+{
+	struct Chanent *ch;
+	int r;
+
+	if ((r = chan_check_va(va)) < 0)
+		return r;
+	if ((ch = chan_find(id)) == NULL)
+		return -E_INVAL;
+	if (ch->ch_env[1] != curenv->env_id || ch->ch_live[1])
+		return -E_INVAL;
+	if ((r = chan_map(ch, 1, va)) < 0)
+		return r;
+	ch->ch_live[1] = 1;
+	return 0;
+}
+
+// Wake the other end of channel 'id' if it is asleep in chan_wait().
+// Producers call this after filling a ring whose cr_sleeping is set,
+// and consumers after draining a ring whose cr_blocked is set.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if curenv is not an end of channel 'id'.
+//	-E_BAD_ENV if the other end has gone away.
+int
+chan_notify(int id)
+{
+	struct Chanent *ch;
+	struct Env *peer;
+	int end, r;
+
+	if ((r = chan_lookup(id, &ch, &end)) < 0)
+		return r;
+	if ((peer = chan_peer(ch, end)) == NULL)
+		return -E_BAD_ENV;
+	if (peer->env_chan_wait == id) {
+		peer->env_chan_wait = -1;
+		sched_set_status(peer, ENV_RUNNABLE);
+	}
+	return 0;
+}
+
+// Sleep until curenv's receive ring of channel 'id' is non-empty, if
+// 'what' is CHAN_WAIT_RECV, or until its send ring has room, if it is
+// CHAN_WAIT_SEND.  The consumer must set cr_sleeping on its ring (the
+// producer cr_blocked), and then check again, before calling this; the
+// other end then knows to call chan_notify().  Returns at once if the
+// ring has changed meanwhile.
+//
+// Returns 0 once the ring is ready, < 0 on error.  Errors are:
+//	-E_INVAL if curenv is not an end of channel 'id', or 'what' is
+//		neither CHAN_WAIT_RECV nor CHAN_WAIT_SEND.
+//	-E_BAD_ENV if the other end has gone away.
+int
+chan_wait(int id, int what)
+{
+	struct Chanent *ch;
+	struct Chan_ring *ring;
+	int end, r;
+
+	if ((r = chan_lookup(id, &ch, &end)) < 0)
+		return r;
+	if (what == CHAN_WAIT_RECV) {
+		ring = page2kva(ch->ch_ring[!end]);
+		if (ring->cr_head != ring->cr_tail)
+			return 0;
+	} else if (what == CHAN_WAIT_SEND) {
+		ring = page2kva(ch->ch_ring[end]);
+		if (ring->cr_tail - ring->cr_head != CHAN_NSLOT)
+			return 0;
+	} else
+		return -E_INVAL;
+	if (chan_peer(ch, end) == NULL)
+		return -E_BAD_ENV;
+
+	curenv->env_chan_wait = id;
+	sched_set_status(curenv, ENV_NOT_RUNNABLE);
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+}
+
+// e is being freed: close its ends of any channels, waking the other
+// end with -E_BAD_ENV if it is asleep.  A channel goes away, along
+// with its rings, once neither end has it mapped any more.
+void
+chan_env_free(struct Env *e)
+{
+	struct Chanent *ch, *next;
+	struct Env *peer;
+	int end, i;
+
+	static_assert(sizeof(struct Chan_ring) <= PGSIZE);
+
+	for (ch = LIST_FIRST(&chans); ch != NULL; ch = next) {
+		next = LIST_NEXT(ch, ch_link);
+		for (end = 0; end < 2; end++) {
+			if (ch->ch_env[end] != e->env_id)
+				continue;
+			ch->ch_env[end] = 0;
+			ch->ch_live[end] = 0;
+			peer = chan_peer(ch, end);
+			if (peer && peer->env_chan_wait == ch->ch_id) {
+				peer->env_chan_wait = -1;
+				peer->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+				sched_set_status(peer, ENV_RUNNABLE);
+			}
+		}
+		if (!ch->ch_live[0] && !ch->ch_live[1]) {
+			for (i = 0; i < 2; i++)
+				page_decref(ch->ch_ring[i]);
+			LIST_REMOVE(ch, ch_link);
+			kmem_cache_free(chan_cache, ch);
+		}
+	}
+}
@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_CHAN_H
+#define JOS_KERN_CHAN_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/chan.h>
+#include <kern/env.h>
+
+int	chan_create(envid_t peer, void *va);
+int	chan_attach(int id, void *va);
+int	chan_notify(int id);
+int	chan_wait(int id, int what);
+void	chan_env_free(struct Env *e);
+
+#endif	// !JOS_KERN_CHAN_H
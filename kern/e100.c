@@ -1,5 +1,6 @@
 #include <inc/x86.h>
 #include <inc/string.h>
+#include <inc/error.h>
 
 #include <kern/env.h>
 #include <kern/pci.h>
@@ -9,10 +10,21 @@
 #include <kern/trap.h>
 #include <kern/picirq.h>
 #include <kern/sched.h>
+#include <kern/kmalloc.h>
 
 static uint8_t e100_irq;
 static uint32_t e100_base;
 
+// Environments waiting in e100_receive() for a packet to arrive.
+struct e100_waiter {
+	envid_t w_envid;
+	TAILQ_ENTRY(e100_waiter) w_link;
+};
+
+static TAILQ_HEAD(, e100_waiter) recv_waiters =
+	TAILQ_HEAD_INITIALIZER(recv_waiters);
+static struct Kmem_cache *e100_waiter_cache;
+
 // Initialize E100 as a PCI device
 int
 e100_attach(struct pci_func *f) {
@@ -32,7 +44,10 @@ e100_attach(struct pci_func *f) {
 	// mask all interrupts except FR, also not marking SI and M bits
 	outb(e100_base + 3, ~((uint8_t) E100_IRQ_FR | E100_IRQ_SI | E100_IRQ_M));
 
-	e100_ring_init();
+	if (e100_ring_init(E100_RING_N) < 0
+	    || !(e100_waiter_cache = kmem_cache_create("e100_waiter",
+				sizeof(struct e100_waiter), NULL)))
+		panic("e100: out of memory");
 	e100_ru_start();
 
 	cprintf("E100 initialized.\n");
@@ -40,8 +55,12 @@ e100_attach(struct pci_func *f) {
 	return 0;
 }
 
-struct e100_tcb e100_tcb_ring[E100_RING_N];
-struct e100_rfd e100_rfd_ring[E100_RING_N];
+// The DMA rings.  Each descriptor comes from a slab cache, so it lies
+// within one page and so is physically contiguous.
+unsigned int e100_ring_n;
+struct e100_tcb **e100_tcb_ring;
+struct e100_rfd **e100_rfd_ring;
+static struct Kmem_cache *e100_tcb_cache, *e100_rfd_cache;
 
 // begin of proceeding queue
 static unsigned int e100_tcb_qbegin = 0;
@@ -53,43 +72,75 @@ static unsigned int e100_tcb_nend = 0;
 // current rfd index
 static unsigned int e100_rfd_idx = 0;
 
-// Initialize E100 DMA rings for receive and transmit
-void
-e100_ring_init() {
-	unsigned int i, j;
+// Constructors for the transmit and receive descriptor caches.
+static void
+e100_tcb_ctor(void *obj)
+{
+	*(struct e100_tcb *) obj = (struct e100_tcb) {
+		.tcb_hdr = {
+			.cb_status = 0,
+			.cb_control = E100_CMD_TRNS,
+		},
+		.tcb_tbd_addr = 0xffffffff,
+		.tcb_byte_n = 0,
+		.tcb_thrs = 0xe0,
+		.tcb_tbd_count = 0
+	};
+}
+
+static void
+e100_rfd_ctor(void *obj)
+{
+	*(struct e100_rfd *) obj = (struct e100_rfd) {
+		.rfd_hdr = {
+			.cb_status = 0,
+			.cb_control = 1 << 4,
+		},
+		.rfd_rsv = 0,
+		.rfd_count = 0,
+		.rfd_size = E100_ETH_MAX_BYTE
+	};
+}
+
+// Initialize E100 DMA rings of n descriptors for receive and transmit.
+// Returns 0 on success, -E_NO_MEM if they cannot be allocated.
+int
+e100_ring_init(unsigned int n) {
+	unsigned int i;
+
+	if (!e100_tcb_cache
+	    && !(e100_tcb_cache = kmem_cache_create("e100_tcb",
+				sizeof(struct e100_tcb), e100_tcb_ctor)))
+		return -E_NO_MEM;
+	if (!e100_rfd_cache
+	    && !(e100_rfd_cache = kmem_cache_create("e100_rfd",
+				sizeof(struct e100_rfd), e100_rfd_ctor)))
+		return -E_NO_MEM;
+	if (!(e100_tcb_ring = kmalloc(n * sizeof(struct e100_tcb *)))
+	    || !(e100_rfd_ring = kmalloc(n * sizeof(struct e100_rfd *))))
+		return -E_NO_MEM;
+	e100_ring_n = n;
+
+	for (i = 0; i < n; ++i)
+		if (!(e100_tcb_ring[i] = kmem_cache_alloc(e100_tcb_cache))
+		    || !(e100_rfd_ring[i] = kmem_cache_alloc(e100_rfd_cache)))
+			return -E_NO_MEM;
 
 	// initialize tcb
 	e100_tcb_qbegin = e100_tcb_qend = 0;
 	e100_tcb_nend = 0;
-	for (i = 0; i < E100_RING_N; ++i) {
-		e100_tcb_ring[i] = (struct e100_tcb) {
-			.tcb_hdr = {
-				.cb_status = 0,
-				.cb_control = E100_CMD_TRNS,
-				.cb_link = (uint32_t) PADDR(&e100_tcb_ring[E100_RING_NEXT(i)])
-			},
-			.tcb_tbd_addr = 0xffffffff,
-			.tcb_byte_n = 0,
-			.tcb_thrs = 0xe0,
-			.tcb_tbd_count = 0
-		};
-		e100_tcb_ring[i].tcb_data[0] = i;
+	for (i = 0; i < n; ++i) {
+		e100_tcb_ring[i]->tcb_hdr.cb_link =
+			(uint32_t) PADDR(e100_tcb_ring[E100_RING_NEXT(i)]);
+		e100_tcb_ring[i]->tcb_data[0] = i;
 	}
 
 	// initialize rfd
-	for (i = 0; i < E100_RING_N; ++i) {
-		e100_rfd_ring[i] = (struct e100_rfd) {
-			.rfd_hdr = {
-				.cb_status = 0,
-				.cb_control = 1 << 4,
-				.cb_link = (uint32_t) PADDR(&e100_rfd_ring[E100_RING_NEXT(i)])
-			},
-			.rfd_rsv = 0,
-			.rfd_count = 0,
-			.rfd_size = E100_ETH_MAX_BYTE
-		};
-	}
-};
+	for (i = 0; i < n; ++i)
+		e100_rfd_ring[i]->rfd_hdr.cb_link =
+			(uint32_t) PADDR(e100_rfd_ring[E100_RING_NEXT(i)]);
+	return 0;
+}
 
 // Returns whether the E100 commit unit (CU) is idle
 bool
@@ -103,7 +154,7 @@ e100_cu_is_idle() {
 int
 e100_cu_start()
 {
-	outl(e100_base + 4, (uint32_t) PADDR(&e100_tcb_ring[e100_tcb_qbegin]));
+	outl(e100_base + 4, (uint32_t) PADDR(e100_tcb_ring[e100_tcb_qbegin]));
 	outb(e100_base + 2, E100_CU_START);
 	return 0;
 }
@@ -112,7 +163,7 @@ e100_cu_start()
 int
 e100_ru_start()
 {
-	outl(e100_base + 4, (uint32_t) PADDR(&e100_rfd_ring[0]));
+	outl(e100_base + 4, (uint32_t) PADDR(e100_rfd_ring[0]));
 	outb(e100_base + 2, E100_RU_START);
 	return 0;
 }
@@ -120,13 +171,13 @@ e100_ru_start()
 // Transmit a buffer with len via e100
 int
 e100_transmit(void *buffer, size_t len) {
-	if (len > E100_ETH_MAX_BYTE)
+	if (!e100_ring_n || len > E100_ETH_MAX_BYTE)
 		return -1;
 
 	// need to reclaim processed packets first
 	if (E100_RING_NEXT(e100_tcb_nend) == e100_tcb_qbegin) {
 		// take out processed items
-		while (e100_tcb_ring[e100_tcb_qbegin].tcb_hdr.cb_status & E100_STATUS_OK)
+		while (e100_tcb_ring[e100_tcb_qbegin]->tcb_hdr.cb_status & E100_STATUS_OK)
 			e100_tcb_qbegin = E100_RING_NEXT(e100_tcb_qbegin);
 
 		if (E100_RING_NEXT(e100_tcb_nend) == e100_tcb_qbegin)
@@ -134,12 +185,12 @@ e100_transmit(void *buffer, size_t len) {
 	}
 
 	// set up content
-	e100_tcb_ring[e100_tcb_nend].tcb_hdr.cb_status = 0;
-	e100_tcb_ring[e100_tcb_nend].tcb_byte_n = len;
-	memmove(e100_tcb_ring[e100_tcb_nend].tcb_data, buffer, len);
+	e100_tcb_ring[e100_tcb_nend]->tcb_hdr.cb_status = 0;
+	e100_tcb_ring[e100_tcb_nend]->tcb_byte_n = len;
+	memmove(e100_tcb_ring[e100_tcb_nend]->tcb_data, buffer, len);
 
 	if (e100_cu_is_idle()) {
-		e100_tcb_ring[e100_tcb_nend].tcb_hdr.cb_control |= E100_CMD_EL;
+		e100_tcb_ring[e100_tcb_nend]->tcb_hdr.cb_control |= E100_CMD_EL;
 		e100_tcb_qbegin = e100_tcb_qend;
 		e100_tcb_qend = E100_RING_NEXT(e100_tcb_nend);
 		e100_cu_start();
@@ -150,20 +201,25 @@ e100_transmit(void *buffer, size_t len) {
 	return 0;
 }
 
-static envid_t recv_q[QUEUE_MAX];
-static unsigned int queue_front = 0;
-static unsigned int queue_back = 0;
 
 // Receive a packet to dst, returning the length
 int
 e100_receive(void *dst)
 {
 	struct e100_rfd *curitem;
+	struct e100_waiter *w;
 	size_t len;
+	int r;
 
-	curitem = &e100_rfd_ring[e100_rfd_idx];
+	// no device attached
+	if (!e100_ring_n)
+		return -1;
+
+	curitem = e100_rfd_ring[e100_rfd_idx];
 	if (curitem->rfd_hdr.cb_status & E100_STATUS_OK) {
 		len = curitem->rfd_count & E100_RFD_COUNT_MASK;
+		if ((r = user_mem_fault_in(curenv, dst, len, PTE_U|PTE_W)) < 0)
+			return r;
 		user_mem_assert(curenv, dst, len, PTE_U|PTE_W);
 		memmove(dst, curitem->rfd_data, len);
 		curitem->rfd_hdr.cb_status = 0;
@@ -171,11 +227,11 @@ e100_receive(void *dst)
 		return len;
 	}
 	else {
-		if ((queue_back + 1) % QUEUE_MAX != queue_front) {
-			recv_q[queue_back] = curenv->env_id;
-			queue_back = (queue_back + 1) % QUEUE_MAX;
+		if ((w = kmem_cache_alloc(e100_waiter_cache)) != NULL) {
+			w->w_envid = curenv->env_id;
+			TAILQ_INSERT_TAIL(&recv_waiters, w, w_link);
 			// block the environment
-			curenv->env_status = ENV_NOT_RUNNABLE;
+			sched_set_status(curenv, ENV_NOT_RUNNABLE);
 			curenv->env_tf.tf_regs.reg_eax = -1;
 			sched_yield();
 		}
@@ -188,10 +244,15 @@ e100_receive(void *dst)
 void
 e100_trap_handler()
 {
+	struct e100_waiter *w;
+	struct Env *e;
+
 	// take an environment from queue
-	if (queue_front != queue_back) {
-		envs[ENVX(recv_q[queue_front])].env_status = ENV_RUNNABLE;
-		queue_front = (queue_front + 1) % QUEUE_MAX;
+	if ((w = TAILQ_FIRST(&recv_waiters)) != NULL) {
+		TAILQ_REMOVE(&recv_waiters, w, w_link);
+		if (envid2env(w->w_envid, &e, 0) == 0)
+			sched_set_status(e, ENV_RUNNABLE);
+		kmem_cache_free(e100_waiter_cache, w);
 	}
 
 	// acknowledge FR interrupt and clear it
@@ -6,9 +6,9 @@
 #include <kern/pci.h>
 #include <kern/env.h>
 
-// length of DMA rings
+// default length of DMA rings
 #define E100_RING_N 128
-#define E100_RING_NEXT(i) (((i) + 1) % E100_RING_N)
+#define E100_RING_NEXT(i) (((i) + 1) % e100_ring_n)
 
 // max size of an Ethernet packet in bytes
 #define E100_ETH_MAX_BYTE 1518
@@ -32,8 +32,6 @@
 
 #define E100_STATUS_OK (1 << 13)
 
-#define QUEUE_MAX 32
-
 struct e100_cb_hdr {
 	volatile uint16_t cb_status;
 	uint16_t cb_control;
@@ -57,8 +55,10 @@ struct e100_rfd {
 	uint8_t rfd_data[E100_ETH_MAX_BYTE];
 } __attribute__ ((packed));
 
+extern unsigned int e100_ring_n;
+
 int e100_attach(struct pci_func *f);
-void e100_ring_init();
+int e100_ring_init(unsigned int n);
 
 int e100_cu_start();
 int e100_ru_start();
@@ -12,12 +12,14 @@
 #include <kern/trap.h>
 #include <kern/monitor.h>
 #include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/chan.h>
 
 struct Env *envs = NULL;		// All environments
-struct Env *curenv = NULL;		// The current env
+uint32_t nenv;				// Number of envs[] entries mapped
 static struct Env_list env_free_list;	// Free list
 
-#define ENVGENSHIFT	12		// >= LOGNENV
+#define ENVGENSHIFT	LOG2NENV	// >= LOG2NENV
 
 //
 // Converts an envid to an env pointer.
@@ -45,8 +47,13 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// to ensure that the envid is not stale
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
+	if (ENVX(envid) >= nenv) {
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
 	e = &envs[ENVX(envid)];
-	if (e->env_status == ENV_FREE || e->env_id != envid) {
+	if (e->env_status == ENV_FREE || e->env_status == ENV_DYING
+	    || e->env_id != envid) {
 		*env_store = 0;
 		return -E_BAD_ENV;
 	}
@@ -66,20 +73,66 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 }
 
 //
-// Mark all environments in 'envs' as free, set their env_ids to 0,
-// and insert them into the env_free_list.
-// Insert in reverse order, so that the first call to env_alloc()
-// returns envs[0].
+// Grow 'envs' by a page: map a fresh page after the end of it, at KENVS
+// for the kernel and read-only at UENVS for users, and insert the
+// environments that now fit entirely in the mapped part into the
+// env_free_list.  Every page directory shares the page tables for
+// KENVS and UENVS (see i386_vm_init()), so all of them see the new page.
+// Insert in reverse order, so that env_alloc() hands out the lowest
+// index first.
 //
-void
-env_init(void)
+// Returns 0 on success, < 0 on failure.  Errors include:
+//	-E_NO_FREE_ENV if 'envs' already has room for NENV environments
+//	-E_NO_MEM on memory exhaustion
+//
+static int
+env_grow(void)
 {
-	int i;
-	for (i = NENV - 1; i >= 0; --i) {
-		(envs[i]).env_status = ENV_FREE;
-		(envs[i]).env_id = 0;
+	struct Page *pp;
+	uint32_t off, i, n;
+	int r;
+
+	if (nenv == NENV)
+		return -E_NO_FREE_ENV;
+
+	// The last mapped env ends less than a page before the end of
+	// the mapping, so this is where the mapping ends.
+	off = ROUNDUP(nenv * sizeof(struct Env), PGSIZE);
+	if ((r = page_alloc_zeroed(&pp)) < 0)
+		return r;
+	if ((r = page_insert(boot_pgdir, pp, (void *) (KENVS + off), PTE_W)) < 0) {
+		page_free(pp);
+		return r;
+	}
+	if ((r = page_insert(boot_pgdir, pp, (void *) (UENVS + off), PTE_U)) < 0) {
+		page_remove(boot_pgdir, (void *) (KENVS + off));
+		return r;
+	}
+
+	n = MIN((off + PGSIZE) / sizeof(struct Env), NENV);
+	for (i = n; i-- > nenv; ) {
+		envs[i].env_status = ENV_FREE;
+		envs[i].env_id = 0;
+		envs[i].env_sched_link.tqe_prev = NULL;
+		TAILQ_INIT(&envs[i].env_ipc_senders);
+		envs[i].env_ipc_link.tqe_prev = NULL;
 		LIST_INSERT_HEAD(&env_free_list, &envs[i], env_link);
 	}
+	nenv = n;
+	return 0;
+}
+
+//
+// Start with an empty 'envs' and map its first page, so that the first
+// call to env_alloc() returns envs[0].
+//
+void
+env_init(void)
+{
+	LIST_INIT(&env_free_list);
+	nenv = 0;
+	if (env_grow() < 0)
+		panic("env_init: cannot map envs");
 }
 
 //
@@ -153,8 +206,11 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = LIST_FIRST(&env_free_list)))
-		return -E_NO_FREE_ENV;
+	if (!(e = LIST_FIRST(&env_free_list))) {
+		if ((r = env_grow()) < 0)
+			return r;
+		e = LIST_FIRST(&env_free_list);
+	}
 
 	// Allocate and set up the page directory for this environment.
 	if ((r = env_setup_vm(e)) < 0)
@@ -168,8 +224,15 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
-	e->env_status = ENV_RUNNABLE;
+	e->env_priority = ENV_PRIO_DEFAULT;
+	e->env_slice = ENV_SLICE_DEFAULT;
+	e->env_slice_left = 0;
+	e->env_affinity = ENV_AFFINITY_ANY;
 	e->env_runs = 0;
+	e->env_cpunum = cpunum();	// Start on the creating CPU's queue
+	e->env_utime = 0;
+	e->env_ktime = 0;
+	sched_set_status(e, ENV_RUNNABLE);
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -194,9 +257,13 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	LIST_INIT(&e->env_vmareas);
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_ipc_batch = NULL;
+	e->env_ipc_call = 0;
+	e->env_chan_wait = -1;
 
 	// If this is the file server (e == &envs[1]) give it I/O privileges.
 	if (e == &envs[1])
@@ -250,7 +317,9 @@ segment_alloc(struct Env *e, void *va, size_t len)
 // loader also needs to read the code from disk.  Take a look at
 // boot/main.c to get ideas.
 //
-// Finally, this function maps one page for the program's initial stack.
+// Finally, this function reserves one page for the program's initial stack.
+// The stack and bss are only given pages as they are touched (see
+// vm_reserve).
 //
 // load_icode panics if it encounters problems.
 //  - How might load_icode fail?  What might be wrong with the given input?
@@ -289,6 +358,7 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 	struct Elf *elf = (struct Elf *) binary;
 	struct Proghdr *ph, *eph;
 	struct Page *pp;
+	uintptr_t fileend, end, bss;
 	int r;
 
 	if (elf->e_magic != ELF_MAGIC)
@@ -301,19 +371,33 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 	lcr3(e->env_cr3);
 	for (; ph < eph; ++ph) {
 		if (ph->p_type == ELF_PROG_LOAD) {
-			segment_alloc(e, (void *) ph->p_va, ph->p_memsz);
+			// Only the pages holding the file's part of the
+			// segment are allocated here; the bss beyond them
+			// is demand-zero.
+			fileend = ph->p_va + ph->p_filesz;
+			end = ph->p_va + ph->p_memsz;
+			if (ph->p_filesz)
+				bss = ROUNDUP(fileend, PGSIZE);
+			else
+				bss = ROUNDDOWN(fileend, PGSIZE);
+			segment_alloc(e, (void *) ph->p_va, ph->p_filesz);
 			// copy segment to memory
 			memmove((void *) ph->p_va, binary + ph->p_offset, ph->p_filesz);
-			// clear remaining memory to zero
-			memset((void *) ph->p_va + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
+			// clear the rest of the last page to zero
+			if (bss > fileend)
+				memset((void *) fileend, 0, MIN(end, bss) - fileend);
+			if (bss < end && vm_reserve(e, bss, end - bss,
+						    PTE_U|PTE_W|PTE_P) < 0)
+				panic("cannot reserve bss");
 		}
 	}
 	// switch back to boot_cr3
 	lcr3(boot_cr3);
 
-	// Now map one page for the program's initial stack
+	// Now reserve one page for the program's initial stack
 	// at virtual address USTACKTOP - PGSIZE.
-	segment_alloc(e, (void *)(USTACKTOP - PGSIZE), PGSIZE);
+	if (vm_reserve(e, USTACKTOP - PGSIZE, PGSIZE, PTE_U|PTE_W|PTE_P) < 0)
+		panic("cannot reserve stack");
 
 	// set up eip as the program's entry point
 	e->env_tf.tf_eip = elf->e_entry;
@@ -344,6 +428,7 @@ env_create(uint8_t *binary, size_t size)
 void
 env_free(struct Env *e)
 {
+	struct Env *s;
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
@@ -357,6 +442,8 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	vm_free(e);
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -365,10 +452,23 @@ env_free(struct Env *e)
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a 4MB page has no page table to free
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			page_remove(e->env_pgdir, PGADDR(pdeno, 0, 0));
+			continue;
+		}
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
 
+		// leave the pages of a shared page table to its other users
+		if (pa2page(pa)->pp_ref > 1) {
+			e->env_pgdir[pdeno] = 0;
+			page_decref(pa2page(pa));
+			continue;
+		}
+
 		// unmap all PTEs in this page table
 		for (pteno = 0; pteno <= PTX(~0); pteno++) {
 			if (pt[pteno] & PTE_P)
@@ -386,8 +486,27 @@ env_free(struct Env *e)
 	e->env_cr3 = 0;
 	page_decref(pa2page(pa));
 
+	// Close e's ends of any channels.
+	chan_env_free(e);
+
+	// Stop waiting to send to anyone, and fail the sends of everyone
+	// still waiting to send to e.
+	if (e->env_ipc_link.tqe_prev != NULL) {
+		struct Env *to = &envs[ENVX(e->env_ipc_send_to)];
+
+		TAILQ_REMOVE(&to->env_ipc_senders, e, env_ipc_link);
+		e->env_ipc_link.tqe_prev = NULL;
+	}
+	while ((s = TAILQ_FIRST(&e->env_ipc_senders)) != NULL) {
+		TAILQ_REMOVE(&e->env_ipc_senders, s, env_ipc_link);
+		s->env_ipc_link.tqe_prev = NULL;
+		s->env_ipc_call = 0;
+		s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		sched_set_status(s, ENV_RUNNABLE);
+	}
+
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	sched_set_status(e, ENV_FREE);
 	LIST_INSERT_HEAD(&env_free_list, e, env_link);
 }
 
@@ -396,9 +515,17 @@ env_free(struct Env *e)
 // If e was the current env, then runs a new environment (and does not return
 // to the caller).
 //
+// If e is currently running on another CPU, it is only marked ENV_DYING;
+// that CPU frees it the next time e traps into the kernel.
+//
 void
 env_destroy(struct Env *e) 
 {
+	if (ENV_RUNNING(e) && e != curenv) {
+		sched_set_status(e, ENV_DYING);
+		return;
+	}
+
 	env_free(e);
 
 	if (curenv == e) {
@@ -449,12 +576,23 @@ env_run(struct Env *e)
 	//	and make sure you have set the relevant parts of
 	//	e->env_tf to sensible values.
 
+	uint64_t now = read_tsc();
+
+	// Charge the time since the last trap to whoever was running.
+	if (curenv)
+		curenv->env_ktime += now - curenv->env_tsc;
+	e->env_tsc = now;
+
 	if (curenv != e) {
 		// new environment running
 		curenv = e;
+		e->env_cpunum = cpunum();
 		++(e->env_runs);
 		lcr3(e->env_cr3);
 	}
+
+	// Let the other CPUs into the kernel before dropping to user mode.
+	unlock_kernel();
 	env_pop_tf(&e->env_tf);
 }
 
@@ -4,6 +4,7 @@
 #define JOS_KERN_ENV_H
 
 #include <inc/env.h>
+#include <kern/cpu.h>
 
 #ifndef JOS_MULTIENV
 // Change this value to 1 once you're allowing multiple environments
@@ -12,10 +13,20 @@
 #endif
 
 extern struct Env *envs;		// All environments
-extern struct Env *curenv;		// Current environment
+extern uint32_t nenv;			// Number of envs[] entries mapped
+#define curenv (thiscpu->cpu_env)		// Current environment
+
+// True if e is the current environment of some CPU.
+#define ENV_RUNNING(e)	(cpus[(e)->env_cpunum].cpu_env == (e))
 
 LIST_HEAD(Env_list, Env);		// Declares 'struct Env_list'
 
+// One of an env's demand-zero regions, on its env_vmareas list.
+struct Vm_area {
+	struct Vm_region vma_region;
+	LIST_ENTRY(Vm_area) vma_link;
+};
+
 void	env_init(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
@@ -3,10 +3,12 @@
 #include <inc/stdio.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
@@ -15,6 +17,10 @@
 #include <kern/time.h>
 #include <kern/pci.h>
 #include <kern/e100.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+static void boot_aps(void);
 
 void
 i386_init(void)
@@ -35,19 +41,36 @@ i386_init(void)
 	// Lab 2 memory management initialization functions
 	i386_detect_memory();
 	i386_vm_init();
+	kmalloc_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	sched_init();
+
+	// Lab 4 multiprocessor initialization functions
+	mp_init();
+	lapic_init();
 	idt_init();
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
-	kclock_init();
+
+	// Every CPU's local APIC timer drives its scheduler; only fall
+	// back to the PIT when there is no local APIC.
+	if (!lapicaddr)
+		kclock_init();
 
 	time_init();
 	pci_init();
 
-	// Should always have an idle process as first one.
+	// Acquire the big kernel lock before waking up APs
+	lock_kernel();
+
+	// Starting non-boot CPUs
+	boot_aps();
+
+	// Should always have an idle process as first one.  It never
+	// runs, but holds envs[0] so that fs and ns get envs[1] and envs[2].
 	ENV_CREATE(user_idle);
 
 	// Start fs.
@@ -72,6 +95,71 @@ i386_init(void)
 	sched_yield();
 }
 
+// While boot_aps is booting a given CPU, it communicates the per-core
+// stack pointer that should be loaded by mpentry.S to that CPU in
+// this variable.
+void *mpentry_kstack;
+
+// Start the non-boot (AP) processors.
+static void
+boot_aps(void)
+{
+	extern unsigned char mpentry_start[], mpentry_end[];
+	void *code;
+	struct CpuInfo *c;
+
+	if (ncpu <= 1)
+		return;
+
+	// Write entry code to unused memory at MPENTRY_PADDR
+	code = KADDR(MPENTRY_PADDR);
+	memmove(code, mpentry_start, mpentry_end - mpentry_start);
+
+	// mpentry.S turns on paging while still running at its physical
+	// address, so map VA 0:4MB same as VA KERNBASE until every AP
+	// has reached mp_main().
+	boot_pgdir[0] = boot_pgdir[PDX(KERNBASE)] & ~PTE_G;
+
+	// Boot each AP one at a time
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == cpus + cpunum())  // We've started already.
+			continue;
+
+		// Tell mpentry.S what stack to use
+		mpentry_kstack = (void *) (KSTACKTOP
+				- (c - cpus) * (KSTKSIZE + KSTKGAP));
+		// Start the CPU at mpentry_start
+		lapic_startap(c->cpu_id, PADDR(code));
+		// Wait for the CPU to finish some basic setup in mp_main()
+		while(c->cpu_status != CPU_STARTED)
+			;
+	}
+
+	// Remove the identity mapping again, and flush it from the TLB.
+	boot_pgdir[0] = 0;
+	lcr3(boot_cr3);
+}
+
+// Setup code for APs
+void
+mp_main(void)
+{
+	// We are in high EIP now, safe to switch to the kernel segments
+	gdt_init_percpu();
+	tlb_init_percpu();
+	cprintf("SMP: CPU %d starting\n", cpunum());
+
+	lapic_init();
+	idt_init_percpu();
+	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
+
+	// Now that we have finished some basic setup, call sched_yield()
+	// to start running processes on this CPU.  But make sure that
+	// only one CPU can enter the scheduler at a time!
+	lock_kernel();
+	sched_yield();
+}
+
 
 /*
  * Variable panicstr contains argument to first call to panic; used as flag
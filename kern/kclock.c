@@ -2,7 +2,8 @@
 
 /* Support for two time-related hardware gadgets: 1) the run time
  * clock with its NVRAM access functions; 2) the 8253 timer, which
- * generates interrupts on IRQ 0.
+ * generates interrupts on IRQ 0, and against which we measure the
+ * TSC frequency.
  */
 
 #include <inc/x86.h>
@@ -13,6 +14,18 @@
 #include <kern/kclock.h>
 #include <kern/picirq.h>
 
+// Bits of the PPI's port B (IO_PPI) that concern the 8253's counter 2.
+#define PPI_GATE2	0x01	/* counter 2 counts while set */
+#define PPI_SPKR	0x02	/* counter 2 drives the speaker */
+#define PPI_OUT2	0x20	/* counter 2's output (read only) */
+
+// Counter 2 counts this many times during a calibration window, which
+// must fit its 16 bits.
+#define CAL_COUNT	(TIMER_FREQ * KCLOCK_CAL_MSEC / 1000)
+// Give up on a PIT that never finishes counting after this many polls.
+#define CAL_MAXPOLL	100000000
+
+static uint8_t cal_ppi;		// IO_PPI before kclock_cal_start()
 
 unsigned
 mc146818_read(unsigned reg)
@@ -41,3 +54,51 @@ kclock_init(void)
 	cprintf("	unmasked timer interrupt\n");
 }
 
+// Start a calibration window of KCLOCK_CAL_MSEC ms, timed by the 8253's
+// counter 2, which is not wired to an interrupt and can be polled
+// through the PPI.  Counter 0 is left alone, in case it drives the
+// clock ticks.  Other clocks are measured against the window by reading
+// them right after this and right after kclock_cal_wait().
+void
+kclock_cal_start(void)
+{
+	// Gate counter 2 on with the speaker off, and have it count down
+	// CAL_COUNT once, raising its output when it is done.
+	cal_ppi = inb(IO_PPI);
+	outb(IO_PPI, (cal_ppi & ~PPI_SPKR) | PPI_GATE2);
+	outb(TIMER_MODE, TIMER_SEL2 | TIMER_INTTC | TIMER_16BIT);
+	outb(TIMER_CNTR2, CAL_COUNT % 256);
+	outb(TIMER_CNTR2, CAL_COUNT / 256);
+}
+
+// Wait for the window started by kclock_cal_start() to end.
+// Returns false if counter 2 does not seem to count.
+bool
+kclock_cal_wait(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < CAL_MAXPOLL; i++)
+		if (inb(IO_PPI) & PPI_OUT2)
+			break;
+	outb(IO_PPI, cal_ppi);
+	return i < CAL_MAXPOLL;
+}
+
+// Return the TSC frequency in Hz, measured against counter 2.
+// Returns 0 if counter 2 does not seem to count.
+uint64_t
+kclock_tsc_hz(void)
+{
+	uint64_t start, end;
+	bool ok;
+
+	kclock_cal_start();
+	start = read_tsc();
+	ok = kclock_cal_wait();
+	end = read_tsc();
+
+	if (!ok)
+		return 0;
+	return (end - start) * 1000 / KCLOCK_CAL_MSEC;
+}
@@ -6,6 +6,8 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 #define	IO_RTC		0x070		/* RTC port */
 
 #define	MC_NVRAM_START	0xe	/* start of NVRAM: offset 14 */
@@ -28,6 +30,12 @@
 
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
+// Length of a kclock_cal_start() window, in ms.
+#define KCLOCK_CAL_MSEC	50
+
 void kclock_init(void);
+void kclock_cal_start(void);
+bool kclock_cal_wait(void);
+uint64_t kclock_tsc_hz(void);
 
 #endif	// !JOS_KERN_KCLOCK_H
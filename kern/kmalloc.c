@@ -0,0 +1,252 @@
+// Slab allocator for kernel objects, on top of page_alloc().
+//
+// A cache hands out objects of one size.  It carves them out of slabs,
+// one page each, that start with a struct Kmem_slab and its free list.
+// The free list is kept apart from the objects, so that a cache's
+// constructor only runs when a slab is created, and objects keep their
+// constructed state while they are free.  kfree() finds an object's slab
+// by rounding its address down to the page.
+//
+// kmalloc() serves small requests from a cache per power-of-two size,
+// and bigger ones with whole blocks of pages from page_alloc_order().
+//
+// Everything here runs under the big kernel lock.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+
+#include <kern/kmalloc.h>
+#include <kern/pmap.h>
+
+#define KMEM_ALIGN	8		// Alignment of every object
+#define KMEM_SLAB_MAGIC	0x51ab51ab
+#define KMEM_NONE	0xffff		// End of a slab's free list
+
+struct Kmem_slab {
+	uint32_t ks_magic;		// KMEM_SLAB_MAGIC
+	struct Kmem_cache *ks_cache;	// Cache the slab belongs to
+	LIST_ENTRY(Kmem_slab) ks_link;	// Link on kc_partial or kc_full
+	uint16_t ks_inuse;		// Objects allocated from this slab
+	uint16_t ks_free;		// Index of the first free object
+	uint16_t ks_next[0];		// Index of the free object after each
+};
+
+// Smallest and largest objects kmalloc() serves from a cache.
+#define KMALLOC_MIN_SHIFT	4
+#define KMALLOC_MAX_SHIFT	11
+#define KMALLOC_NCACHE		(KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+static LIST_HEAD(Kmem_cache_list, Kmem_cache) caches;
+static struct Kmem_cache cache_cache;	// Where caches come from
+static struct Kmem_cache *kmalloc_caches[KMALLOC_NCACHE];
+static const char *kmalloc_names[KMALLOC_NCACHE] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+// Fill in kc for objects of the given size and add it to the list of
+// caches.
+static void
+kmem_cache_init(struct Kmem_cache *kc, const char *name, size_t size,
+		void (*ctor)(void *obj))
+{
+	uint32_t n;
+
+	size = ROUNDUP(MAX(size, 1), KMEM_ALIGN);
+	n = (PGSIZE - sizeof(struct Kmem_slab)) / (size + sizeof(uint16_t));
+	while (n > 0 && ROUNDUP(sizeof(struct Kmem_slab) + n * sizeof(uint16_t),
+				KMEM_ALIGN) + n * size > PGSIZE)
+		n--;
+	assert(n > 0 && n < KMEM_NONE);
+
+	memset(kc, 0, sizeof(*kc));
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_perslab = n;
+	kc->kc_offset = ROUNDUP(sizeof(struct Kmem_slab) + n * sizeof(uint16_t),
+				KMEM_ALIGN);
+	LIST_INIT(&kc->kc_partial);
+	LIST_INIT(&kc->kc_full);
+	LIST_INSERT_HEAD(&caches, kc, kc_link);
+}
+
+// Return the i'th object of slab ks.
+static void *
+slab_obj(struct Kmem_slab *ks, int i)
+{
+	return (char *) ks + ks->ks_cache->kc_offset + i * ks->ks_cache->kc_size;
+}
+
+// Allocate a new slab for kc and construct all its objects.
+// Returns NULL if there is no memory.
+static struct Kmem_slab *
+slab_create(struct Kmem_cache *kc)
+{
+	struct Kmem_slab *ks;
+	struct Page *pp;
+	uint32_t i;
+
+	if (page_alloc(&pp) < 0)
+		return NULL;
+	pp->pp_ref = 1;
+	ks = page2kva(pp);
+	ks->ks_magic = KMEM_SLAB_MAGIC;
+	ks->ks_cache = kc;
+	ks->ks_inuse = 0;
+	ks->ks_free = 0;
+	for (i = 0; i < kc->kc_perslab; i++) {
+		ks->ks_next[i] = (i + 1 < kc->kc_perslab) ? i + 1 : KMEM_NONE;
+		if (kc->kc_ctor)
+			kc->kc_ctor(slab_obj(ks, i));
+	}
+	kc->kc_nslabs++;
+	return ks;
+}
+
+// Create a cache of objects of 'size' bytes, which must fit in a page
+// along with a slab header.  If ctor is not NULL, it is called on every
+// object once, when its slab is created; objects must be in their
+// constructed state when they are freed.
+// Returns NULL if there is no memory.
+struct Kmem_cache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj))
+{
+	struct Kmem_cache *kc;
+
+	if ((kc = kmem_cache_alloc(&cache_cache)) == NULL)
+		return NULL;
+	kmem_cache_init(kc, name, size, ctor);
+	return kc;
+}
+
+// Allocate an object from kc.
+// Returns NULL if there is no memory.
+void *
+kmem_cache_alloc(struct Kmem_cache *kc)
+{
+	struct Kmem_slab *ks;
+	int i;
+
+	if ((ks = LIST_FIRST(&kc->kc_partial)) == NULL) {
+		if ((ks = kc->kc_empty) != NULL)
+			kc->kc_empty = NULL;
+		else if ((ks = slab_create(kc)) == NULL)
+			return NULL;
+		LIST_INSERT_HEAD(&kc->kc_partial, ks, ks_link);
+	}
+
+	i = ks->ks_free;
+	ks->ks_free = ks->ks_next[i];
+	ks->ks_inuse++;
+	if (ks->ks_free == KMEM_NONE) {
+		LIST_REMOVE(ks, ks_link);
+		LIST_INSERT_HEAD(&kc->kc_full, ks, ks_link);
+	}
+	kc->kc_nobjs++;
+	return slab_obj(ks, i);
+}
+
+// Return obj, which was allocated from kc, to kc.  A slab that ends up
+// empty is kept as kc's spare, or given back to the page allocator if
+// kc already has one.
+void
+kmem_cache_free(struct Kmem_cache *kc, void *obj)
+{
+	struct Kmem_slab *ks = ROUNDDOWN(obj, PGSIZE);
+	int i;
+
+	assert(ks->ks_magic == KMEM_SLAB_MAGIC && ks->ks_cache == kc);
+	i = ((char *) obj - (char *) slab_obj(ks, 0)) / kc->kc_size;
+	assert(obj == slab_obj(ks, i) && i < kc->kc_perslab);
+
+	if (ks->ks_free == KMEM_NONE) {
+		LIST_REMOVE(ks, ks_link);
+		LIST_INSERT_HEAD(&kc->kc_partial, ks, ks_link);
+	}
+	ks->ks_next[i] = ks->ks_free;
+	ks->ks_free = i;
+	ks->ks_inuse--;
+	kc->kc_nobjs--;
+
+	if (ks->ks_inuse == 0) {
+		LIST_REMOVE(ks, ks_link);
+		if (kc->kc_empty) {
+			ks->ks_magic = 0;
+			page_decref(pa2page(PADDR(ks)));
+			kc->kc_nslabs--;
+		} else
+			kc->kc_empty = ks;
+	}
+}
+
+// Allocate 'size' bytes of kernel memory, aligned to KMEM_ALIGN, or
+// to a page if size is bigger than the largest kmalloc cache.
+// Returns NULL if there is no memory.
+void *
+kmalloc(size_t size)
+{
+	struct Page *pp;
+	int shift;
+
+	for (shift = KMALLOC_MIN_SHIFT; shift <= KMALLOC_MAX_SHIFT; shift++)
+		if (size <= (1 << shift))
+			return kmem_cache_alloc(
+				kmalloc_caches[shift - KMALLOC_MIN_SHIFT]);
+
+	for (shift = 0; (PGSIZE << shift) < size; shift++)
+		if (shift == PAGE_NORDER - 1)
+			return NULL;
+	if (page_alloc_order(shift, &pp) < 0)
+		return NULL;
+	pp->pp_ref = 1;
+	return page2kva(pp);
+}
+
+// Free memory allocated with kmalloc().  Slab objects never start on a
+// page boundary, so ptr is a block of pages if it does.
+void
+kfree(void *ptr)
+{
+	struct Kmem_slab *ks;
+
+	if (ptr == NULL)
+		return;
+	if (PGOFF(ptr) == 0) {
+		page_decref(pa2page(PADDR(ptr)));
+		return;
+	}
+	ks = ROUNDDOWN(ptr, PGSIZE);
+	kmem_cache_free(ks->ks_cache, ptr);
+}
+
+// Print the state of every cache.
+void
+kmem_print_caches(void)
+{
+	struct Kmem_cache *kc;
+
+	cprintf("  %-16s %6s %8s %6s\n", "cache", "size", "objects", "slabs");
+	LIST_FOREACH(kc, &caches, kc_link)
+		cprintf("  %-16s %6d %8d %6d\n", kc->kc_name, kc->kc_size,
+			kc->kc_nobjs, kc->kc_nslabs);
+}
+
+// Set up the cache of caches and the kmalloc() caches.
+void
+kmalloc_init(void)
+{
+	int i;
+
+	static_assert(sizeof(struct Kmem_slab) % 2 == 0);
+
+	LIST_INIT(&caches);
+	kmem_cache_init(&cache_cache, "kmem_cache", sizeof(struct Kmem_cache),
+			NULL);
+	for (i = 0; i < KMALLOC_NCACHE; i++)
+		if ((kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i],
+				1 << (i + KMALLOC_MIN_SHIFT), NULL)) == NULL)
+			panic("kmalloc_init: out of memory");
+}
@@ -0,0 +1,40 @@
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/queue.h>
+
+// Slab allocator for kernel objects.  See kern/kmalloc.c.
+
+LIST_HEAD(Kmem_slab_list, Kmem_slab);
+
+struct Kmem_cache {
+	const char *kc_name;		// For the slabinfo monitor command
+	size_t kc_size;			// Object size, rounded up to KMEM_ALIGN
+	void (*kc_ctor)(void *obj);	// Constructor, or NULL
+	uint32_t kc_perslab;		// Objects per slab
+	uint32_t kc_offset;		// Offset of the first object in a slab
+	struct Kmem_slab_list kc_partial; // Slabs with free objects
+	struct Kmem_slab_list kc_full;	// Slabs without any
+	struct Kmem_slab *kc_empty;	// One spare slab, kept for reuse
+	uint32_t kc_nslabs;		// Slabs in use, including kc_empty
+	uint32_t kc_nobjs;		// Objects allocated
+	LIST_ENTRY(Kmem_cache) kc_link;	// Link on the list of all caches
+};
+
+void	kmalloc_init(void);
+
+struct Kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *obj));
+void	*kmem_cache_alloc(struct Kmem_cache *kc);
+void	kmem_cache_free(struct Kmem_cache *kc, void *obj);
+
+void	*kmalloc(size_t size);
+void	kfree(void *ptr);
+
+void	kmem_print_caches(void);
+
+#endif	// !JOS_KERN_KMALLOC_H
@@ -13,6 +13,8 @@
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/kmalloc.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -31,6 +33,9 @@ static struct Command commands[] = {
 	{ "alloc_page", "Allocate a page in the memory", mon_alloc_page },
 	{ "page_status", "Show status of a page with given physical address", mon_page_status },
 	{ "free_page", "Free a page with given physical address", mon_free_page },
+	{ "ps", "List environments and the CPU time they used", mon_ps },
+	{ "buddyinfo", "Show the free blocks of each size in the page allocator", mon_buddyinfo },
+	{ "slabinfo", "Show the kernel object caches", mon_slabinfo },
 	
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
@@ -141,6 +146,48 @@ mon_free_page(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_ps(int argc, char **argv, struct Trapframe *tf)
+{
+	static const char *status[] = { "free", "runnable", "blocked", "dying" };
+	struct Env *e;
+
+	cprintf("  envid    status   prio slice cpu affinity  runs  user cycles  kernel cycles\n");
+	for (e = envs; e < envs + nenv; e++) {
+		if (e->env_status == ENV_FREE)
+			continue;
+		cprintf("  %08x %-8s %4d %5d %3d %08x %5d %12llu %14llu\n",
+			e->env_id, status[e->env_status], e->env_priority,
+			e->env_slice, e->env_cpunum, e->env_affinity,
+			e->env_runs, e->env_utime, e->env_ktime);
+	}
+	return 0;
+}
+
+int
+mon_buddyinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	size_t n, total = 0;
+	int order;
+
+	cprintf("  order   block   free blocks\n");
+	for (order = 0; order < PAGE_NORDER; order++) {
+		n = page_free_blocks(order);
+		total += n << order;
+		cprintf("  %5d %6dK %13d\n", order, (PGSIZE << order) / 1024, n);
+	}
+	cprintf("  %d free pages, and %d zeroed ones\n", total,
+		page_zero_pool_size());
+	return 0;
+}
+
+int
+mon_slabinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_print_caches();
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
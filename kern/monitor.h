@@ -18,5 +18,8 @@ int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
 int mon_alloc_page(int argc, char **argv, struct Trapframe *tf);
 int mon_page_status(int argc, char **argv, struct Trapframe *tf);
 int mon_free_page(int argc, char **argv, struct Trapframe *tf);
+int mon_ps(int argc, char **argv, struct Trapframe *tf);
+int mon_buddyinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_slabinfo(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
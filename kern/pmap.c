@@ -9,6 +9,9 @@
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/kmalloc.h>
+#include <kern/time.h>
 
 // These variables are set by i386_detect_memory()
 static physaddr_t maxpa;	// Maximum physical address
@@ -19,10 +22,17 @@ static size_t extmem;		// Amount of extended memory (in bytes)
 // These variables are set in i386_vm_init()
 pde_t* boot_pgdir;		// Virtual address of boot time page directory
 physaddr_t boot_cr3;		// Physical address of boot time page directory
+static uint32_t pte_global;	// PTE_G if the CPU has global pages, else 0
 static char* boot_freemem;	// Pointer to next byte of free mem
 
 struct Page* pages;		// Virtual address of physical page array
-static struct Page_list page_free_list;	// Free list of physical pages
+
+// Free lists of the buddy allocator: free_area[i] holds the free blocks
+// of 2^i pages.
+static struct Free_area {
+	struct Page_list fa_list;
+	size_t fa_nfree;		// Number of blocks on fa_list
+} free_area[PAGE_NORDER];
 
 // Global descriptor table.
 //
@@ -30,7 +40,7 @@ static struct Page_list page_free_list;	// Free list of physical pages
 // To load the SS register, the CPL must equal the DPL.  Thus,
 // we must duplicate the segments for the user and the kernel.
 //
-struct Segdesc gdt[] =
+struct Segdesc gdt[NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -47,8 +57,9 @@ struct Segdesc gdt[] =
 	// 0x20 - user data segment
 	[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
 
-	// 0x28 - tss, initialized in idt_init()
-	[GD_TSS >> 3] = SEG_NULL
+	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
+	// in idt_init_percpu()
+	[GD_TSS0 >> 3] = SEG_NULL
 };
 
 struct Pseudodesc gdt_pd = {
@@ -89,6 +100,8 @@ static void check_boot_pgdir(void);
 static void check_page_alloc();
 static void page_check(void);
 static void boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int perm);
+static void pt_remove(pde_t *pgdir, void *va);
+static int pt_unshare(pde_t *pgdir, const void *va);
 
 //
 // A simple physical memory allocator, used only a few times
@@ -143,7 +156,7 @@ void
 i386_vm_init(void)
 {
 	pde_t* pgdir;
-	uint32_t cr0;
+	uint32_t cr0, features;
 	size_t n;
 
 	//////////////////////////////////////////////////////////////////////
@@ -153,6 +166,15 @@ i386_vm_init(void)
 	boot_pgdir = pgdir;
 	boot_cr3 = PADDR(pgdir);
 
+	// Mark the kernel's mappings global if the CPU supports it,
+	// so that they survive address space switches.  A kernel built
+	// with 'make NOPGE=1' leaves them alone, for comparison.
+	cpuid(1, NULL, NULL, NULL, &features);
+#ifndef JOS_NO_PGE
+	if (features & CPUID_FEAT_PGE)
+		pte_global = PTE_G;
+#endif
+
 	//////////////////////////////////////////////////////////////////////
 	// Recursively insert PD in itself as a page table, to form
 	// a virtual page table at virtual address VPT.
@@ -175,8 +197,15 @@ i386_vm_init(void)
 	pages = boot_alloc(npage * sizeof(struct Page), PGSIZE);
 
 	//////////////////////////////////////////////////////////////////////
-	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
-	envs = boot_alloc(NENV * sizeof(struct Env), PGSIZE);
+	// 'envs' lives at KENVS, where env_alloc() maps pages for it as
+	// they are needed (see env_grow()).
+	static_assert(NENV * sizeof(struct Env) <= PTSIZE);
+	envs = (struct Env *) KENVS;
+
+	//////////////////////////////////////////////////////////////////////
+	// Allocate the page that time_tick() keeps the time in.
+	timepage = boot_alloc(PGSIZE, PGSIZE);
+	memset(timepage, 0, PGSIZE);
 
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
@@ -201,25 +230,40 @@ i386_vm_init(void)
     boot_map_segment(pgdir, UPAGES, ROUNDUP(npage * sizeof(struct Page), PGSIZE), PADDR(pages), PTE_U|PTE_P);
 
 	//////////////////////////////////////////////////////////////////////
-	// Map the 'envs' array read-only by the user at linear address UENVS
-	// (ie. perm = PTE_U | PTE_P).
+	// The 'envs' array is mapped at KENVS for the kernel and read-only
+	// by the user at UENVS, one page at a time as it grows.  Create
+	// both page tables now: every page directory shares them from here
+	// on, so the pages env_grow() adds show up in all of them.
+	if (!pgdir_walk(pgdir, (void *) KENVS, 1)
+	    || !pgdir_walk(pgdir, (void *) UENVS, 1))
+		panic("i386_vm_init: out of memory for the envs page tables");
+
+	//////////////////////////////////////////////////////////////////////
+	// Map the time page read-only by the user at UTIME.
 	// Permissions:
-	//    - the new image at UENVS  -- kernel R, user R
-	//    - envs itself -- kernel RW, user NONE
-	boot_map_segment(pgdir, UENVS, ROUNDUP(NENV * sizeof(struct Env), PGSIZE), PADDR(envs), PTE_U|PTE_P);
+	//    - the new image at UTIME -- kernel R, user R
+	//    - timepage itself -- kernel RW, user NONE
+	boot_map_segment(pgdir, UTIME, PGSIZE, PADDR(timepage), PTE_U|PTE_P);
 
 	//////////////////////////////////////////////////////////////////////
-	// Use the physical memory that 'bootstack' refers to as the kernel
-	// stack.  The kernel stack grows down from virtual address KSTACKTOP.
-	// We consider the entire range from [KSTACKTOP-PTSIZE, KSTACKTOP) 
-	// to be the kernel stack, but break this into two pieces:
-	//     * [KSTACKTOP-KSTKSIZE, KSTACKTOP) -- backed by physical memory
-	//     * [KSTACKTOP-PTSIZE, KSTACKTOP-KSTKSIZE) -- not backed; so if
-	//       the kernel overflows its stack, it will fault rather than
-	//       overwrite memory.  Known as a "guard page".
+	// Map the per-CPU kernel stacks.  CPU i's stack grows down from
+	// virtual address kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP)
+	// and is divided into two pieces, just like the single kernel stack
+	// in previous labs:
+	//     * [kstacktop_i - KSTKSIZE, kstacktop_i) -- backed by
+	//       percpu_kstacks[i]
+	//     * [kstacktop_i - (KSTKSIZE + KSTKGAP), kstacktop_i - KSTKSIZE)
+	//       -- not backed; so if the kernel overflows its stack, it will
+	//       fault rather than overwrite another CPU's stack.
 	//     Permissions: kernel RW, user NONE
-	boot_map_segment(pgdir, KSTACKTOP-KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W|PTE_P);
-	boot_map_segment(pgdir, KSTACKTOP-PTSIZE, PTSIZE-KSTKSIZE, 0, 0);
+	//
+	// CPU 0 keeps running on 'bootstack' until it first enters user
+	// mode, but every trap after that lands on percpu_kstacks[0].
+	boot_map_segment(pgdir, KSTACKTOP-PTSIZE, PTSIZE, 0, 0);
+	for (n = 0; n < NCPU; n++)
+		boot_map_segment(pgdir, KSTACKTOP - n * (KSTKSIZE + KSTKGAP) - KSTKSIZE,
+				 KSTKSIZE, PADDR(percpu_kstacks[n]),
+				 PTE_W|PTE_P|pte_global);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE. 
@@ -228,7 +272,9 @@ i386_vm_init(void)
 	// We might not have 2^32 - KERNBASE bytes of physical memory, but
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
-	boot_map_segment(pgdir, KERNBASE, ~KERNBASE + 1, 0, PTE_W|PTE_P);
+	// Use 4MB pages, which need no page tables and far fewer TLB entries.
+	boot_map_segment(pgdir, KERNBASE, ~KERNBASE + 1, 0,
+			 PTE_PS|PTE_W|PTE_P|pte_global);
 
 	// Check that the initial page directory has been set up correctly.
 	check_boot_pgdir();
@@ -249,9 +295,11 @@ i386_vm_init(void)
 
 	// Map VA 0:4MB same as VA KERNBASE, i.e. to PA 0:4MB.
 	// (Limits our kernel to <4MB)
-	pgdir[0] = pgdir[PDX(KERNBASE)];
+	// Not as a global page: lcr3() must be able to flush it again.
+	pgdir[0] = pgdir[PDX(KERNBASE)] & ~PTE_G;
 
-	// Install page table.
+	// Enable 4MB pages, then install page table.
+	lcr4(rcr4() | CR4_PSE);
 	lcr3(boot_cr3);
 
 	// Turn on paging.
@@ -264,6 +312,42 @@ i386_vm_init(void)
 	// (x < 4MB so uses paging pgdir[0])
 
 	// Reload all segment registers.
+	gdt_init_percpu();
+
+	// Final mapping: KERNBASE+x => KERNBASE+x => x.
+
+	// This mapping was only used after paging was turned on but
+	// before the segment registers were reloaded.
+	pgdir[0] = 0;
+
+	// Flush the TLB for good measure, to kill the pgdir[0] mapping.
+	lcr3(boot_cr3);
+
+	tlb_init_percpu();
+}
+
+//
+// Turn on global pages on this CPU, if the CPU has them.
+// The kernel's own mappings above ULIM are the same in every address
+// space, so i386_vm_init() marks them PTE_G; then the lcr3() in
+// env_run() only flushes the user part of the TLB.
+//
+// (Process-context identifiers would also keep the user entries of
+// other environments, but they only exist in 64-bit mode.)
+//
+void
+tlb_init_percpu(void)
+{
+	if (pte_global)
+		lcr4(rcr4() | CR4_PGE);
+}
+
+// Load the GDT and reload all segment registers on the calling CPU.
+// The boot CPU calls this from i386_vm_init(); the other CPUs call it
+// from mp_main() once they are running on the kernel page directory.
+void
+gdt_init_percpu(void)
+{
 	asm volatile("lgdt gdt_pd");
 	asm volatile("movw %%ax,%%gs" :: "a" (GD_UD|3));
 	asm volatile("movw %%ax,%%fs" :: "a" (GD_UD|3));
@@ -272,15 +356,31 @@ i386_vm_init(void)
 	asm volatile("movw %%ax,%%ss" :: "a" (GD_KD));
 	asm volatile("ljmp %0,$1f\n 1:\n" :: "i" (GD_KT));  // reload cs
 	asm volatile("lldt %%ax" :: "a" (0));
+}
 
-	// Final mapping: KERNBASE+x => KERNBASE+x => x.
+//
+// The checks below need to run out of memory on purpose.  Allocate every
+// free page onto *fl, and later give them all back.
+//
+static void
+check_steal_free(struct Page_list *fl)
+{
+	struct Page *pp;
 
-	// This mapping was only used after paging was turned on but
-	// before the segment registers were reloaded.
-	pgdir[0] = 0;
+	LIST_INIT(fl);
+	while (page_alloc(&pp) == 0)
+		LIST_INSERT_HEAD(fl, pp, pp_link);
+}
 
-	// Flush the TLB for good measure, to kill the pgdir[0] mapping.
-	lcr3(boot_cr3);
+static void
+check_return_free(struct Page_list *fl)
+{
+	struct Page *pp;
+
+	while ((pp = LIST_FIRST(fl)) != NULL) {
+		LIST_REMOVE(pp, pp_link);
+		page_free(pp);
+	}
 }
 
 //
@@ -292,25 +392,33 @@ check_page_alloc()
 {
 	struct Page *pp, *pp0, *pp1, *pp2;
 	struct Page_list fl;
+	int i, o;
 
 	// if there's a page that shouldn't be on
 	// the free list, try to make sure it
 	// eventually causes trouble.
-	LIST_FOREACH(pp0, &page_free_list, pp_link)
-		memset(page2kva(pp0), 0x97, 128);
-
-	LIST_FOREACH(pp0, &page_free_list, pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp0 >= pages);
-		assert(pp0 < pages + npage);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp0) != 0);
-		assert(page2pa(pp0) != IOPHYSMEM);
-		assert(page2pa(pp0) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp0) != EXTPHYSMEM);
-		assert(page2kva(pp0) != ROUNDDOWN(boot_freemem - 1, PGSIZE));
-	}
+	for (o = 0; o < PAGE_NORDER; o++)
+		LIST_FOREACH(pp0, &free_area[o].fa_list, pp_link)
+			for (i = 0; i < (1 << o); i++)
+				memset(page2kva(pp0 + i), 0x97, 128);
+
+	for (o = 0; o < PAGE_NORDER; o++)
+		LIST_FOREACH(pp0, &free_area[o].fa_list, pp_link) {
+			// check that we didn't corrupt the free lists
+			assert(pp0 >= pages);
+			assert(pp0 + (1 << o) <= pages + npage);
+			assert(pp0->pp_free && pp0->pp_order == o);
+			assert((page2ppn(pp0) & ((1 << o) - 1)) == 0);
+
+			// check a few pages that shouldn't be free
+			for (pp = pp0; pp < pp0 + (1 << o); pp++) {
+				assert(page2pa(pp) != 0);
+				assert(page2pa(pp) != IOPHYSMEM);
+				assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+				assert(page2pa(pp) != EXTPHYSMEM);
+				assert(page2kva(pp) != ROUNDDOWN(boot_freemem - 1, PGSIZE));
+			}
+		}
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -326,8 +434,7 @@ check_page_alloc()
 	assert(page2pa(pp2) < npage*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	LIST_INIT(&page_free_list);
+	check_steal_free(&fl);
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
@@ -346,13 +453,40 @@ check_page_alloc()
 	assert(page_alloc(&pp) == -E_NO_MEM);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free(&fl);
 
 	// free the pages we took
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
 
+	// blocks are aligned to their size
+	assert(page_alloc_order(PAGE_NORDER, &pp) == -E_INVAL);
+	assert(page_alloc_order(2, &pp0) == 0);
+	assert(pp0->pp_order == 2 && (page2ppn(pp0) & 3) == 0);
+	check_steal_free(&fl);
+
+	// freeing the pages of a block one by one merges them again
+	for (i = 0; i < 4; i++)
+		page_free(pp0 + i);
+	assert(page_free_blocks(0) == 0 && page_free_blocks(1) == 0);
+	assert(page_free_blocks(2) == 1);
+	assert(page_alloc_order(2, &pp) == 0 && pp == pp0);
+	assert(page_alloc(&pp) == -E_NO_MEM);
+	assert(page_alloc_order(1, &pp) == -E_NO_MEM);
+
+	// and allocating a single page splits it
+	page_free_order(pp0, 2);
+	assert(page_alloc(&pp) == 0 && pp == pp0);
+	assert(page_free_blocks(0) == 1 && page_free_blocks(1) == 1);
+	assert(page_free_blocks(2) == 0);
+	assert(page_alloc_order(1, &pp) == 0 && pp == pp0 + 2);
+	assert(page_alloc(&pp) == 0 && pp == pp0 + 1);
+	for (i = 0; i < 4; i++)
+		page_free(pp0 + i);
+
+	check_return_free(&fl);
+
 	cprintf("check_page_alloc() succeeded!\n");
 }
 
@@ -379,18 +513,28 @@ check_boot_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
 	
-	// check envs array (new test for lab 3)
-	n = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
-	for (i = 0; i < n; i += PGSIZE)
-		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
+	// check time page
+	assert(check_va2pa(pgdir, UTIME) == PADDR(timepage));
+
+	// check envs array: nothing is mapped until env_init()
+	for (i = 0; i < PTSIZE; i += PGSIZE) {
+		assert(check_va2pa(pgdir, UENVS + i) == ~0);
+		assert(check_va2pa(pgdir, KENVS + i) == ~0);
+	}
 
 	// check phys mem
 	for (i = 0; i < npage * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
-	// check kernel stack
-	for (i = 0; i < KSTKSIZE; i += PGSIZE)
-		assert(check_va2pa(pgdir, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
+	// check kernel stacks
+	for (n = 0; n < NCPU; n++) {
+		uint32_t base = KSTACKTOP - (KSTKSIZE + KSTKGAP) * (n + 1);
+		for (i = 0; i < KSTKSIZE; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + KSTKGAP + i)
+				== PADDR(percpu_kstacks[n]) + i);
+		for (i = 0; i < KSTKGAP; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + i) == ~0);
+	}
 	assert(check_va2pa(pgdir, KSTACKTOP - PTSIZE) == ~0);
 
 	// check for zero/non-zero in PDEs
@@ -401,6 +545,8 @@ check_boot_pgdir(void)
 		case PDX(KSTACKTOP-1):
 		case PDX(UPAGES):
 		case PDX(UENVS):
+		case PDX(KENVS):
+		case PDX(UTIME):
 			assert(pgdir[i]);
 			break;
 		default:
@@ -427,6 +573,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_ADDR(*pgdir) + (PTX(va) << PTXSHIFT);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -451,26 +599,34 @@ page_init(void)
 	//  1) Mark physical page 0 as in use.
 	//     This way we preserve the real-mode IDT and BIOS structures
 	//     in case we ever need them.  (Currently we don't, but...)
-	//  2) The rest of base memory, [PGSIZE, basemem) is free.
+	//  2) The rest of base memory, [PGSIZE, basemem) is free, except
+	//     for the page at MPENTRY_PADDR, where boot_aps() copies the
+	//     AP bootstrap code.
 	//  3) Then comes the IO hole [IOPHYSMEM, EXTPHYSMEM).
 	//     Mark it as in use so that it can never be allocated.
 	//  4) Then extended memory [EXTPHYSMEM, ...).
 	//     Some of it is in use, some is free. Where is the kernel
 	//     in physical memory?  Which pages are already in use for
 	//     page tables and other data structures?
+	//
+	// Free pages are handed to page_free() in address order, which
+	// merges them into the largest blocks their alignment allows.
 	int i;
-	LIST_INIT(&page_free_list);
+	for (i = 0; i < PAGE_NORDER; i++) {
+		LIST_INIT(&free_area[i].fa_list);
+		free_area[i].fa_nfree = 0;
+	}
+	memset(pages, 0, npage * sizeof(struct Page));
 	for (i = 0; i < npage; i++) {
 		if (i == 0
+			|| i == MPENTRY_PADDR / PGSIZE
 			|| (i >= IOPHYSMEM / PGSIZE && i < EXTPHYSMEM / PGSIZE)
 			|| (i >= EXTPHYSMEM / PGSIZE
 				&& i < (unsigned int) PADDR(boot_freemem) / PGSIZE)) {
 			pages[i].pp_ref = 1; // mark as inuse
 		}
-		else {
-			pages[i].pp_ref = 0;
-			LIST_INSERT_HEAD(&page_free_list, &pages[i], pp_link);
-		}
+		else
+			page_free(&pages[i]);
 	}
 }
 
@@ -485,6 +641,51 @@ page_initpp(struct Page *pp)
 	memset(pp, 0, sizeof(*pp));
 }
 
+// Put the block of 2^order pages starting at pp on its free list.
+static void
+free_area_insert(struct Page *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_free = 1;
+	LIST_INSERT_HEAD(&free_area[order].fa_list, pp, pp_link);
+	free_area[order].fa_nfree++;
+}
+
+// Take the free block starting at pp off its free list.
+static void
+free_area_remove(struct Page *pp)
+{
+	LIST_REMOVE(pp, pp_link);
+	free_area[pp->pp_order].fa_nfree--;
+	pp->pp_order = 0;
+	pp->pp_free = 0;
+}
+
+//
+// Free pages that are already zeroed, so that page_alloc_zeroed() need
+// not clear a page on its caller's time.  page_zero_fill() tops the pool
+// up when a CPU has nothing better to do.  Pool pages are off the buddy
+// free lists; page_alloc_order() gives them back when memory runs out.
+//
+#define ZERO_POOL_MAX	256	// Most pages kept zeroed
+#define ZERO_FILL_BATCH	16	// Most pages zeroed per page_zero_fill()
+
+static struct Page_list zero_pool;
+static size_t zero_pool_n;
+
+// Give all the pages in the zero pool back to the buddy free lists.
+static void
+zero_pool_drain(void)
+{
+	struct Page *pp;
+
+	while ((pp = LIST_FIRST(&zero_pool)) != NULL) {
+		LIST_REMOVE(pp, pp_link);
+		page_free(pp);
+	}
+	zero_pool_n = 0;
+}
+
 //
 // Allocates a physical page.
 // Does NOT set the contents of the physical page to zero, NOR does it
@@ -501,14 +702,58 @@ page_initpp(struct Page *pp)
 int
 page_alloc(struct Page **pp_store)
 {
-	// if no pages are free, return
-	if (LIST_EMPTY(&page_free_list)) 
+	struct Page *pp;
+
+	// Fast path: take a single free page if there is one.
+	if ((pp = LIST_FIRST(&free_area[0].fa_list)) == NULL)
+		return page_alloc_order(0, pp_store);
+	free_area_remove(pp);
+	page_initpp(pp);
+	*pp_store = pp;
+	return 0;
+}
+
+//
+// Allocates a block of 2^order physically contiguous pages, aligned to
+// its size, by splitting the smallest free block that is big enough.
+// As with page_alloc(), the pages are neither cleared nor referenced.
+//
+// *pp_store -- is set to point to the Page struct of the first page;
+// the others follow it in the 'pages' array.  Its pp_order is 'order'.
+//
+// RETURNS
+//   0 -- on success
+//   -E_INVAL -- if order is not below PAGE_NORDER
+//   -E_NO_MEM -- if there is no free block that big
+//
+int
+page_alloc_order(int order, struct Page **pp_store)
+{
+	struct Page *pp;
+	int o;
+
+	if (order < 0 || order >= PAGE_NORDER)
+		return -E_INVAL;
+	for (o = order; o < PAGE_NORDER; o++)
+		if (!LIST_EMPTY(&free_area[o].fa_list))
+			break;
+	if (o == PAGE_NORDER && zero_pool_n > 0) {
+		zero_pool_drain();
+		return page_alloc_order(order, pp_store);
+	}
+	if (o == PAGE_NORDER)
 		return -E_NO_MEM;
 
-	*pp_store = LIST_FIRST(&page_free_list);
-	LIST_REMOVE(*pp_store, pp_link);
-	page_initpp(*pp_store);
-	(*pp_store)->pp_ref = 0;
+	pp = LIST_FIRST(&free_area[o].fa_list);
+	free_area_remove(pp);
+	// Give back the upper half of the block until it is small enough.
+	while (o > order) {
+		o--;
+		free_area_insert(pp + (1 << o), o);
+	}
+	page_initpp(pp);
+	pp->pp_order = order;
+	*pp_store = pp;
 	return 0;
 }
 
@@ -519,7 +764,100 @@ page_alloc(struct Page **pp_store)
 void
 page_free(struct Page *pp)
 {
-	LIST_INSERT_HEAD(&page_free_list, pp, pp_link);
+	page_free_order(pp, 0);
+}
+
+//
+// Return the block of 2^order pages starting at pp, which need not have
+// been allocated as one block, to the free lists, merging it with its
+// buddy for as long as that is free too.
+//
+void
+page_free_order(struct Page *pp, int order)
+{
+	ppn_t ppn = page2ppn(pp), buddy;
+
+	assert(order >= 0 && order < PAGE_NORDER);
+	assert(!pp->pp_free && (ppn & ((1 << order) - 1)) == 0);
+
+	pp->pp_order = 0;
+	for (; order < PAGE_NORDER - 1; order++) {
+		buddy = ppn ^ (1 << order);
+		if (buddy >= npage || !pages[buddy].pp_free
+		    || pages[buddy].pp_order != order)
+			break;
+		free_area_remove(&pages[buddy]);
+		ppn &= ~(1 << order);
+	}
+	free_area_insert(&pages[ppn], order);
+}
+
+// Return the number of free blocks of 2^order pages.
+size_t
+page_free_blocks(int order)
+{
+	assert(order >= 0 && order < PAGE_NORDER);
+	return free_area[order].fa_nfree;
+}
+
+//
+// Allocates a physical page, as page_alloc() does, but also sets its
+// contents to zero.  Takes a page from the zero pool if there is one.
+//
+// RETURNS
+//   0 -- on success
+//   -E_NO_MEM -- otherwise
+//
+int
+page_alloc_zeroed(struct Page **pp_store)
+{
+	struct Page *pp;
+	int r;
+
+	if ((pp = LIST_FIRST(&zero_pool)) != NULL) {
+		LIST_REMOVE(pp, pp_link);
+		zero_pool_n--;
+		page_initpp(pp);
+		*pp_store = pp;
+		return 0;
+	}
+	if ((r = page_alloc(&pp)) < 0)
+		return r;
+	memset(page2kva(pp), 0, PGSIZE);
+	*pp_store = pp;
+	return 0;
+}
+
+//
+// Zero a few free pages into the zero pool, unless it is full.
+// The scheduler calls this when it has nothing to run, just before it
+// halts the CPU, so that the work is done off everyone's critical path.
+//
+void
+page_zero_fill(void)
+{
+	struct Page *pp;
+	int i, o;
+
+	for (i = 0; i < ZERO_FILL_BATCH && zero_pool_n < ZERO_POOL_MAX; i++) {
+		// Stop once the free lists are empty, or page_alloc()
+		// would drain the pool again to find a page.
+		for (o = 0; o < PAGE_NORDER; o++)
+			if (!LIST_EMPTY(&free_area[o].fa_list))
+				break;
+		if (o == PAGE_NORDER || page_alloc(&pp) < 0)
+			break;
+		memset(page2kva(pp), 0, PGSIZE);
+		LIST_INSERT_HEAD(&zero_pool, pp, pp_link);
+		zero_pool_n++;
+	}
+}
+
+// Return the number of pages in the zero pool.
+size_t
+page_zero_pool_size(void)
+{
+	return zero_pool_n;
 }
 
 //
@@ -530,7 +868,7 @@ void
 page_decref(struct Page* pp)
 {
 	if (--pp->pp_ref == 0)
-		page_free(pp);
+		page_free_order(pp, pp->pp_order);
 }
 
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
@@ -545,17 +883,22 @@ page_decref(struct Page* pp)
 //    - pgdir_walk clears the new page table.
 //    - Finally, pgdir_walk returns a pointer into the new page table.
 //
+// A non-zero 'create' also means that the caller is going to change the
+// PTE, so a page table shared with other page directories is copied
+// first (see pt_unshare); pgdir_walk returns NULL if that fails.
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
 	struct Page *pp;
 
+	if (pgdir[PDX(va)] & PTE_PS) // 4MB page: the PDE is the mapping
+		return &pgdir[PDX(va)];
 	if (!(pgdir[PDX(va)] & PTE_P)) { // not present
 		if (create == 0)
 			return NULL; // don't create, just fail
-		// create with page_alloc()
-		if (page_alloc(&pp) == 0) {
-			memset(KADDR(page2pa(pp)), 0, PGSIZE);
+		// create with page_alloc_zeroed()
+		if (page_alloc_zeroed(&pp) == 0) {
 			pp->pp_ref = 1;
 			pgdir[PDX(va)] = page2pa(pp)|PTE_P|PTE_W|PTE_U;
 			return (pte_t *) KADDR(page2pa(pp)) + PTX(va);
@@ -564,6 +907,8 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 			return NULL; // fails creating a new table
 	}
 	else {
+		if (create && pt_unshare(pgdir, va) < 0)
+			return NULL;
 		return (pte_t *) KADDR(PTE_ADDR(pgdir[PDX(va)])) + PTX(va);
 	}
 }
@@ -587,14 +932,34 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
 //
+// If perm includes PTE_PS, pp must be the first page of a PS_ORDER block
+// and va must be PTSIZE-aligned; the block is then mapped as a single
+// 4MB page, replacing any page table for [va, va+PTSIZE) and all the
+// pages mapped by it.  Likewise, a 4MB page covering va is removed
+// before a page table can be allocated for va.
+//
 int
 page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm) 
 {
-	pte_t *pt_entry = pgdir_walk(pgdir, va, 1);
-	if (pt_entry == NULL)
-		return -E_NO_MEM;
+	pde_t *pde = &pgdir[PDX(va)];
+	pte_t *pt_entry;
 
+	// Take our reference first, in case pp is already mapped at va.
 	++(pp->pp_ref);
+	if (perm & PTE_PS) {
+		assert(PGOFF(va) == 0 && PTX(va) == 0 && pp->pp_order == PS_ORDER);
+		if ((*pde & PTE_P) && !(*pde & PTE_PS))
+			pt_remove(pgdir, va);
+		pt_entry = pde;
+	} else {
+		if (*pde & PTE_PS)
+			page_remove(pgdir, va);
+		if ((pt_entry = pgdir_walk(pgdir, va, 1)) == NULL) {
+			--(pp->pp_ref);
+			return -E_NO_MEM;
+		}
+	}
+
 	if (*pt_entry & PTE_P) {
 		page_remove(pgdir, va);
 	}
@@ -603,10 +968,38 @@ page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
 	return 0;
 }
 
+//
+// Unmap all the pages mapped by the page table for va, and free the
+// page table itself.
+//
+static void
+pt_remove(pde_t *pgdir, void *va)
+{
+	pte_t *pt = KADDR(PTE_ADDR(pgdir[PDX(va)]));
+	uintptr_t base = ROUNDDOWN((uintptr_t) va, PTSIZE);
+	int i;
+
+	// Just drop our reference to a shared page table.
+	if (pa2page(PADDR(pt))->pp_ref > 1) {
+		page_decref(pa2page(PADDR(pt)));
+		pgdir[PDX(va)] = 0;
+		if (rcr3() == PADDR(pgdir))
+			lcr3(PADDR(pgdir));
+		return;
+	}
+	for (i = 0; i < NPTENTRIES; i++)
+		if (pt[i] & PTE_P)
+			page_remove(pgdir, (void *) (base + i * PGSIZE));
+	page_decref(pa2page(PADDR(pt)));
+	pgdir[PDX(va)] = 0;
+}
+
 //
 // Map [la, la+size) of linear address space to physical [pa, pa+size)
 // in the page table rooted at pgdir.  Size is a multiple of PGSIZE.
 // Use permission bits perm|PTE_P for the entries.
+// If perm includes PTE_PS, la, pa and size must be multiples of PTSIZE,
+// and the range is mapped with 4MB pages directly in the page directory.
 //
 // This function is only intended to set up the ``static'' mappings
 // above UTOP. As such, it should *not* change the pp_ref field on the
@@ -617,14 +1010,49 @@ boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int per
 {
 	pte_t *pt_entry;
 	unsigned int i;
+
+	if (perm & PTE_PS) {
+		assert(la % PTSIZE == 0 && pa % PTSIZE == 0 && size % PTSIZE == 0);
+		for (i = 0; i < size; i += PTSIZE)
+			pgdir[PDX(la + i)] = (pa + i)|perm;
+		return;
+	}
 	for (i = 0; i < size; i += PGSIZE) {
 		pt_entry = pgdir_walk(pgdir, (const void *) (la + i), 1);
 		*pt_entry = PTE_ADDR(pa + i)|perm;
 	}
 }
 
+//
+// Reserve size bytes in the MMIO region and map [pa,pa+size) at this
+// location.  Return the base of the reserved region.  size does *not*
+// have to be multiple of PGSIZE.
+//
+// The mapping is uncached (PTE_PCD|PTE_PWT), since it is device memory,
+// and kernel-only.  Panics if the reservation would overflow MMIOLIM.
+//
+void *
+mmio_map_region(physaddr_t pa, size_t size)
+{
+	// Where to start the next region.  Initially, this is the
+	// beginning of the MMIO region.  Because this is static, its
+	// value will be preserved between calls to mmio_map_region.
+	static uintptr_t base = MMIOBASE;
+	uintptr_t va = base;
+
+	size = ROUNDUP(pa + size, PGSIZE) - ROUNDDOWN(pa, PGSIZE);
+	if (base + size > MMIOLIM || base + size < base)
+		panic("mmio_map_region: reservation overflows MMIOLIM");
+	boot_map_segment(boot_pgdir, va, size, ROUNDDOWN(pa, PGSIZE),
+			 PTE_PCD|PTE_PWT|PTE_W|PTE_P|pte_global);
+	base += size;
+	return (void *) (va + (pa & (PGSIZE - 1)));
+}
+
 //
 // Return the page mapped at virtual address 'va'.
+// If va is in a 4MB page, this is the first page of its block, and the
+// "pte" is the page directory entry, with PTE_PS set.
 // If pte_store is not zero, then we store in it the address
 // of the pte for this page.  This is used by page_remove and
 // can be used to verify page permissions for syscall arguments,
@@ -647,6 +1075,7 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently does nothing.
+// If va is in a 4MB page, the whole 4MB page is unmapped.
 //
 // Details:
 //   - The ref count on the physical page should decrement.
@@ -656,17 +1085,315 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //   - The TLB must be invalidated if you remove an entry from
 //     the pg dir/pg table.
 //
-void
+// RETURNS
+//   0 on success, or if there was nothing to do
+//   -E_NO_MEM if va's page table is shared (see pt_share) and there is
+//     no memory to copy it; the mapping is then left where it is
+//
+int
 page_remove(pde_t *pgdir, void *va)
 {
 	struct Page *pp;
 	pte_t *pt_entry;
 	pp = page_lookup(pgdir, va, &pt_entry);
 	if (pp == NULL)
-		return;
+		return 0;
+	if (pt_unshare(pgdir, va) < 0)
+		return -E_NO_MEM;
+	pt_entry = pgdir_walk(pgdir, va, 0);
 	page_decref(pp);
 	*pt_entry = 0;
 	tlb_invalidate(pgdir, va);
+	return 0;
+}
+
+//
+// Page tables that map nothing writable or copy-on-write, such as those
+// for program text, can be shared by several page directories, counting
+// each one in the page table's pp_ref.  The pages they map are only
+// counted once, for the page table.  A shared page table is copied as
+// soon as one of its users needs to change it.
+//
+
+// Return true if pgdir has a page table for va that maps no writable or
+// copy-on-write pages, and so can be shared.
+bool
+pt_shareable(pde_t *pgdir, const void *va)
+{
+	pte_t *pt;
+	int i;
+
+	if ((pgdir[PDX(va)] & (PTE_P|PTE_PS)) != PTE_P)
+		return 0;
+	pt = KADDR(PTE_ADDR(pgdir[PDX(va)]));
+	for (i = 0; i < NPTENTRIES; i++)
+		if ((pt[i] & PTE_P) && (pt[i] & (PTE_W|PTE_COW)))
+			return 0;
+	return 1;
+}
+
+//
+// Make dst use src's page table for [va, va+PTSIZE), which must be
+// shareable (see pt_shareable), in place of none.
+//
+void
+pt_share(pde_t *dst, pde_t *src, const void *va)
+{
+	assert(!(dst[PDX(va)] & PTE_P));
+	pa2page(PTE_ADDR(src[PDX(va)]))->pp_ref++;
+	dst[PDX(va)] = src[PDX(va)];
+}
+
+//
+// Give pgdir its own copy of the page table for va if it shares it with
+// other page directories, so that it can be changed.
+//
+// RETURNS
+//   0 on success, or if there was nothing to do
+//   -E_NO_MEM if there is no memory for the copy
+//
+static int
+pt_unshare(pde_t *pgdir, const void *va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct Page *opt, *npt;
+	pte_t *pt;
+	int i;
+
+	if ((*pde & (PTE_P|PTE_PS)) != PTE_P)
+		return 0;
+	opt = pa2page(PTE_ADDR(*pde));
+	if (opt->pp_ref == 1)
+		return 0;
+
+	if (page_alloc(&npt) < 0)
+		return -E_NO_MEM;
+	npt->pp_ref = 1;
+	pt = page2kva(npt);
+	memmove(pt, page2kva(opt), PGSIZE);
+	for (i = 0; i < NPTENTRIES; i++)
+		if (pt[i] & PTE_P)
+			pa2page(PTE_ADDR(pt[i]))->pp_ref++;
+	opt->pp_ref--;
+	*pde = page2pa(npt) | PGOFF(*pde);
+
+	// The translations have not changed, but the CPU may have cached
+	// the old page table's location.
+	if (rcr3() == PADDR(pgdir))
+		lcr3(PADDR(pgdir));
+	return 0;
+}
+
+//
+// Copy the user part of the address space 'src' into the empty 'dst',
+// copy-on-write: pages that are writable or already copy-on-write become
+// read-only and PTE_COW in both, unless they are PTE_SHARE; other pages
+// are simply shared, as are read-only page tables.  4MB pages are
+// treated like small ones, as a whole.  The user exception stack page is
+// not copied.
+// The caller must flush the TLB if src is in use.
+//
+// RETURNS
+//   0 on success
+//   -E_NO_MEM if a page table could not be allocated; dst is then only
+//     partly filled in, and should be freed
+//
+int
+pgdir_copy_cow(pde_t *dst, pde_t *src)
+{
+	struct Page *pp;
+	pte_t *spt, *dpt, pte;
+	uint32_t pdeno, pteno;
+
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (!(src[pdeno] & PTE_P))
+			continue;
+		if (src[pdeno] & PTE_PS) {
+			if ((src[pdeno] & (PTE_W|PTE_COW))
+			    && !(src[pdeno] & PTE_SHARE))
+				src[pdeno] = (src[pdeno] & ~PTE_W) | PTE_COW;
+			pa2page(PTE_ADDR(src[pdeno]))->pp_ref++;
+			dst[pdeno] = src[pdeno];
+			continue;
+		}
+		if (pt_shareable(src, PGADDR(pdeno, 0, 0))) {
+			pt_share(dst, src, PGADDR(pdeno, 0, 0));
+			continue;
+		}
+		spt = KADDR(PTE_ADDR(src[pdeno]));
+
+		if (page_alloc_zeroed(&pp) < 0)
+			return -E_NO_MEM;
+		pp->pp_ref = 1;
+		dpt = page2kva(pp);
+		dst[pdeno] = page2pa(pp)|PTE_P|PTE_W|PTE_U;
+
+		for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+			pte = spt[pteno];
+			if (!(pte & PTE_P)
+			    || PGADDR(pdeno, pteno, 0) == (void *) (UXSTACKTOP - PGSIZE))
+				continue;
+			pte &= ~0xFFF | PTE_USER;
+			if ((pte & (PTE_W|PTE_COW)) && !(pte & PTE_SHARE))
+				spt[pteno] = pte = (pte & ~PTE_W) | PTE_COW;
+			pa2page(PTE_ADDR(pte))->pp_ref++;
+			dpt[pteno] = pte;
+		}
+	}
+	return 0;
+}
+
+//
+// Resolve a write to 'va', which pgdir maps copy-on-write: give pgdir
+// its own writable copy of the page, or, if no one else maps the page
+// any more, just make it writable again.  A 4MB page is copied whole.
+//
+// RETURNS
+//   0 on success
+//   -E_INVAL if va is not mapped copy-on-write
+//   -E_NO_MEM if there is no memory for the copy
+//
+int
+page_cow_break(pde_t *pgdir, void *va)
+{
+	struct Page *pp, *npp;
+	pte_t *pte;
+	int order, perm, r;
+
+	if ((pp = page_lookup(pgdir, va, &pte)) == NULL
+	    || !(*pte & PTE_COW))
+		return -E_INVAL;
+	perm = (*pte & (PTE_USER|PTE_PS) & ~PTE_COW) | PTE_W;
+	order = (*pte & PTE_PS) ? PS_ORDER : 0;
+	va = ROUNDDOWN(va, PGSIZE << order);
+
+	if (pp->pp_ref == 1) {
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+	if ((r = order ? page_alloc_order(order, &npp) : page_alloc(&npp)) < 0)
+		return r;
+	memmove(page2kva(npp), page2kva(pp), PGSIZE << order);
+	if ((r = page_insert(pgdir, npp, va, perm)) < 0) {
+		page_free_order(npp, order);
+		return r;
+	}
+	return 0;
+}
+
+//
+// Reserve [va, va+len) in e as a demand-zero region with permissions
+// perm (see struct Vm_region), or, if len is 0, drop the region that
+// starts at va.  Pages already mapped in the range are left alone.
+// The caller checks that va is page-aligned and the range is below UTOP.
+//
+// RETURNS
+//   0 on success
+//   -E_INVAL if the range overlaps one of e's regions, or with len 0,
+//     if no region starts at va
+//   -E_NO_MEM if there is no memory for the region descriptor
+//
+int
+vm_reserve(struct Env *e, uintptr_t va, size_t len, int perm)
+{
+	struct Vm_area *vma;
+	struct Vm_region *vr;
+
+	len = ROUNDUP(len, PGSIZE);
+	LIST_FOREACH(vma, &e->env_vmareas, vma_link) {
+		vr = &vma->vma_region;
+		if (len == 0 && vr->vr_start == va) {
+			LIST_REMOVE(vma, vma_link);
+			kfree(vma);
+			return 0;
+		}
+		if (va < vr->vr_start + vr->vr_len && vr->vr_start < va + len)
+			return -E_INVAL;
+	}
+	if (len == 0)
+		return -E_INVAL;
+
+	if ((vma = kmalloc(sizeof(struct Vm_area))) == NULL)
+		return -E_NO_MEM;
+	vma->vma_region.vr_start = va;
+	vma->vma_region.vr_len = len;
+	vma->vma_region.vr_perm = perm;
+	LIST_INSERT_HEAD(&e->env_vmareas, vma, vma_link);
+	return 0;
+}
+
+//
+// Give dst, which has no demand-zero regions, a copy of src's.
+//
+// RETURNS
+//   0 on success
+//   -E_NO_MEM if there is no memory for the region descriptors
+//
+int
+vm_copy(struct Env *dst, struct Env *src)
+{
+	struct Vm_area *vma;
+	struct Vm_region *vr;
+	int r;
+
+	LIST_FOREACH(vma, &src->env_vmareas, vma_link) {
+		vr = &vma->vma_region;
+		if ((r = vm_reserve(dst, vr->vr_start, vr->vr_len,
+				    vr->vr_perm)) < 0)
+			return r;
+	}
+	return 0;
+}
+
+//
+// Drop all of e's demand-zero regions.
+//
+void
+vm_free(struct Env *e)
+{
+	struct Vm_area *vma;
+
+	while ((vma = LIST_FIRST(&e->env_vmareas)) != NULL) {
+		LIST_REMOVE(vma, vma_link);
+		kfree(vma);
+	}
+}
+
+//
+// Map a fresh zeroed page at va in e, if va is inside one of e's
+// demand-zero regions and nothing is mapped there yet.
+//
+// RETURNS
+//   0 on success
+//   -E_INVAL if va is not in a region, or is already mapped
+//   -E_NO_MEM if there is no memory for the page or a page table
+//
+int
+vm_demand_zero(struct Env *e, void *va)
+{
+	struct Vm_area *vma;
+	struct Vm_region *vr = NULL;
+	struct Page *pp;
+	int r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	LIST_FOREACH(vma, &e->env_vmareas, vma_link)
+		if ((uintptr_t) va - vma->vma_region.vr_start
+		    < vma->vma_region.vr_len) {
+			vr = &vma->vma_region;
+			break;
+		}
+	if (vr == NULL || page_lookup(e->env_pgdir, va, NULL))
+		return -E_INVAL;
+
+	if ((r = page_alloc_zeroed(&pp)) < 0)
+		return r;
+	if ((r = page_insert(e->env_pgdir, pp, va, vr->vr_perm)) < 0) {
+		page_free(pp);
+		return r;
+	}
+	return 0;
 }
 
 //
@@ -730,6 +1457,39 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	return 0;
 }
 
+//
+// Get the range of memory [va, va+len) of environment 'env' ready for
+// the kernel to access with permissions 'perm', as the same accesses by
+// env itself would: map in its untouched demand-zero pages and, if perm
+// includes PTE_W, give it its own copy of any copy-on-write pages.
+// Call this before user_mem_check() on memory the kernel will write,
+// or that may not have been touched yet.  Pages env may not access at
+// all are left for user_mem_check() to reject.
+//
+// Returns 0 on success, or -E_NO_MEM if there was no memory for a page.
+//
+int
+user_mem_fault_in(struct Env *env, const void *va, size_t len, int perm)
+{
+	const void *p;
+	pte_t *pte;
+	int r;
+
+	if ((uintptr_t) va >= ULIM || len > ULIM - (uintptr_t) va)
+		return 0;
+	for (p = ROUNDDOWN(va, PGSIZE); p < va + len; p += PGSIZE) {
+		if (!page_lookup(env->env_pgdir, (void *) p, &pte))
+			r = vm_demand_zero(env, (void *) p);
+		else if ((perm & PTE_W) && (*pte & PTE_COW))
+			r = page_cow_break(env->env_pgdir, (void *) p);
+		else
+			continue;
+		if (r == -E_NO_MEM)
+			return r;
+	}
+	return 0;
+}
+
 //
 // Checks that environment 'env' is allowed to access the range
 // of memory [va, va+len) with permissions 'perm | PTE_U'.
@@ -768,8 +1528,7 @@ page_check(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	LIST_INIT(&page_free_list);
+	check_steal_free(&fl);
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
@@ -895,7 +1654,7 @@ page_check(void)
 	pp0->pp_ref = 0;
 
 	// give free list back */
-	page_free_list = fl;
+	check_return_free(&fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -50,17 +50,43 @@ extern struct Pseudodesc gdt_pd;
 
 void	i386_vm_init();
 void	i386_detect_memory();
+void	gdt_init_percpu(void);
+void	tlb_init_percpu(void);
+
+// The buddy allocator hands out blocks of 2^order physically contiguous,
+// naturally aligned pages, for orders up to PS_ORDER: one PTSIZE block,
+// which can be mapped as a single 4MB page with PTE_PS.
+#define PS_ORDER	(PDXSHIFT - PGSHIFT)
+#define PAGE_NORDER	(PS_ORDER + 1)
 
 void	page_init(void);
 int	page_alloc(struct Page **pp_store);
+int	page_alloc_order(int order, struct Page **pp_store);
 void	page_free(struct Page *pp);
+void	page_free_order(struct Page *pp, int order);
+size_t	page_free_blocks(int order);
+int	page_alloc_zeroed(struct Page **pp_store);
+void	page_zero_fill(void);
+size_t	page_zero_pool_size(void);
 int	page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm);
-void	page_remove(pde_t *pgdir, void *va);
+int	page_remove(pde_t *pgdir, void *va);
 struct Page *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct Page *pp);
 
+int	pgdir_copy_cow(pde_t *dst, pde_t *src);
+void	pt_share(pde_t *dst, pde_t *src, const void *va);
+bool	pt_shareable(pde_t *pgdir, const void *va);
+int	page_cow_break(pde_t *pgdir, void *va);
+int	vm_reserve(struct Env *e, uintptr_t va, size_t len, int perm);
+int	vm_demand_zero(struct Env *e, void *va);
+int	vm_copy(struct Env *dst, struct Env *src);
+void	vm_free(struct Env *e);
+
 void	tlb_invalidate(pde_t *pgdir, void *va);
 
+void	*mmio_map_region(physaddr_t pa, size_t size);
+
+int	user_mem_fault_in(struct Env *env, const void *va, size_t len, int perm);
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
 
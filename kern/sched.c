@@ -1,44 +1,349 @@
 #include <inc/assert.h>
+#include <inc/trap.h>
+#include <inc/x86.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/time.h>
 
+TAILQ_HEAD(Runq, Env);			// Declares 'struct Runq'
+
+// Each CPU schedules from its own set of run queues: one FIFO of runnable
+// environments per priority level.  The envs that are currently running
+// are not on any queue; sched_yield() puts each back at the tail of its
+// queue when it gives up its CPU.  A CPU whose queues are empty steals
+// work from the busiest other CPU before it halts.
+//
+// All of this is still protected by the big kernel lock.
+struct Cpuq {
+	struct Runq runq[NPRIO];
+	// Bit p is set iff runq[p] is non-empty, so that picking the
+	// highest priority runnable environment does not depend on NENV
+	// or NPRIO.
+	uint32_t mask;
+	uint32_t nqueued;		// Total number of queued envs
+};
+
+static struct Cpuq cpuq[NCPU];
+
+// envs[0], the idle environment, is never queued or run: a CPU with
+// nothing to do halts in sched_halt() instead.
+#define ENV_IDLE	(&envs[0])
+
+// tqe_prev is NULL whenever the env is off the run queues.
+#define ENV_QUEUED(e)	((e)->env_sched_link.tqe_prev != NULL)
+
+// The CPUs that actually exist.
+#define CPU_MASK_ALL	((uint32_t) ((1 << ncpu) - 1))
+
+void
+sched_init(void)
+{
+	int i, p;
+
+	for (i = 0; i < NCPU; i++) {
+		for (p = 0; p < NPRIO; p++)
+			TAILQ_INIT(&cpuq[i].runq[p]);
+		cpuq[i].mask = 0;
+		cpuq[i].nqueued = 0;
+	}
+}
+
+// Choose which CPU's queue e should wait on.  Prefer the CPU it last ran
+// on, whose caches are warm, then the calling CPU, then the lowest
+// numbered CPU allowed by e's affinity.
+static int
+runq_choose_cpu(struct Env *e)
+{
+	uint32_t allowed = e->env_affinity & CPU_MASK_ALL;
+
+	assert(allowed != 0);
+	if (allowed & (1 << e->env_cpunum))
+		return e->env_cpunum;
+	if (allowed & (1 << cpunum()))
+		return cpunum();
+	return __builtin_ctz(allowed);
+}
+
+static void
+runq_insert(struct Env *e)
+{
+	struct Cpuq *q;
+
+	if (e == ENV_IDLE || ENV_QUEUED(e))
+		return;
+	e->env_runq_cpu = runq_choose_cpu(e);
+	q = &cpuq[e->env_runq_cpu];
+	TAILQ_INSERT_TAIL(&q->runq[e->env_priority], e, env_sched_link);
+	q->mask |= 1 << e->env_priority;
+	q->nqueued++;
+
+	// A halted CPU has stopped its timer, so it will not notice its
+	// new work until it is woken.
+	if (e->env_runq_cpu != cpunum()
+	    && cpus[e->env_runq_cpu].cpu_status == CPU_HALTED)
+		lapic_ipi_cpu(cpus[e->env_runq_cpu].cpu_id, T_WAKEUP);
+}
+
+static void
+runq_remove(struct Env *e)
+{
+	struct Cpuq *q;
+
+	if (!ENV_QUEUED(e))
+		return;
+	q = &cpuq[e->env_runq_cpu];
+	TAILQ_REMOVE(&q->runq[e->env_priority], e, env_sched_link);
+	e->env_sched_link.tqe_prev = NULL;
+	if (TAILQ_EMPTY(&q->runq[e->env_priority]))
+		q->mask &= ~(1 << e->env_priority);
+	q->nqueued--;
+}
+
+// Return the highest priority non-empty run queue, or -1 if all are empty.
+static int
+runq_top(struct Cpuq *q)
+{
+	if (q->mask == 0)
+		return -1;
+	return 31 - __builtin_clz(q->mask);
+}
+
+// Return the highest priority env on CPU from's queues that is allowed
+// to run on CPU to, or NULL if there is none.
+static struct Env *
+runq_first_allowed(int from, int to)
+{
+	struct Env *e;
+	int prio;
+
+	for (prio = runq_top(&cpuq[from]); prio >= 0; prio--)
+		TAILQ_FOREACH(e, &cpuq[from].runq[prio], env_sched_link)
+			if (e->env_affinity & (1 << to))
+				return e;
+	return NULL;
+}
+
+// Take an env off the busiest other CPU's queues for CPU 'cpu' to run.
+// Returns NULL if no other CPU has anything 'cpu' may run.
+static struct Env *
+runq_steal(int cpu)
+{
+	struct Env *e, *victim = NULL;
+	uint32_t most = 0;
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		if (i == cpu || cpuq[i].nqueued <= most)
+			continue;
+		if ((e = runq_first_allowed(i, cpu)) != NULL) {
+			victim = e;
+			most = cpuq[i].nqueued;
+		}
+	}
+	if (victim)
+		runq_remove(victim);
+	return victim;
+}
+
+// Change e's status, keeping the run queues in sync.
+// Every update to env_status in the kernel should go through here.
+// An env that is running on some CPU is left off the queues until it
+// yields.
+void
+sched_set_status(struct Env *e, unsigned status)
+{
+	// Only a blocked env can be waiting for a timer.
+	if (status != ENV_NOT_RUNNABLE)
+		time_cancel(e);
+	e->env_status = status;
+	if (status == ENV_RUNNABLE && !ENV_RUNNING(e))
+		runq_insert(e);
+	else
+		runq_remove(e);
+}
+
+// Move e to the run queue for priority 'prio'.
+void
+sched_set_priority(struct Env *e, uint32_t prio)
+{
+	assert(prio < NPRIO);
+	if (ENV_QUEUED(e)) {
+		runq_remove(e);
+		e->env_priority = prio;
+		runq_insert(e);
+	} else
+		e->env_priority = prio;
+}
+
+// Restrict e to the CPUs in 'mask', which must include at least one CPU
+// that exists.  A queued env moves to an allowed CPU's queue right away;
+// a running env migrates the next time it yields or is preempted.
+void
+sched_set_affinity(struct Env *e, uint32_t mask)
+{
+	assert(mask & CPU_MASK_ALL);
+	e->env_affinity = mask;
+	if (ENV_QUEUED(e)) {
+		runq_remove(e);
+		runq_insert(e);
+	}
+}
+
+// Return true if some env queued on this CPU has a higher priority than
+// the one currently running, so the caller should reschedule.
+bool
+sched_need_resched(void)
+{
+	struct Cpuq *q = &cpuq[cpunum()];
+
+	if (!curenv)
+		return q->mask != 0;
+	return runq_top(q) > (int) curenv->env_priority;
+}
+
+// Called on every timer interrupt.  Preempt the current env only once
+// its slice has run out.
+void
+sched_tick(void)
+{
+	if (curenv && curenv->env_slice_left > 1) {
+		curenv->env_slice_left--;
+		return;
+	}
+	sched_yield();
+}
+
+// Take the highest priority env off this CPU's queues, or if they are
+// empty, steal one from another CPU.  Returns NULL if there is nothing
+// to run.
+static struct Env *
+runq_pick(void)
+{
+	struct Cpuq *q = &cpuq[cpunum()];
+	struct Env *e;
+	int prio;
+
+	if ((prio = runq_top(q)) >= 0) {
+		e = TAILQ_FIRST(&q->runq[prio]);
+		runq_remove(e);
+		return e;
+	}
+	return runq_steal(cpunum());
+}
 
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	// Implement simple round-robin scheduling.
-	// Search through 'envs' for a runnable environment,
-	// in circular fashion starting after the previously running env,
-	// and switch to the first such environment found.
-	// It's OK to choose the previously running env if no other env
-	// is runnable.
-	// But never choose envs[0], the idle environment,
-	// unless NOTHING else is runnable.
-
-	static unsigned int last_run = 0;
-	unsigned int i, idx;
-
-	// start from next one
-	for (i = 0; i < NENV; ++i) {
-		idx = ENVX(last_run + i + 1);
-		if (idx > 0 && envs[idx].env_status == ENV_RUNNABLE) {
-			last_run = idx;
-			env_run(&envs[idx]);
-			return;
-		}
+	// Put the current env back at the tail of its queue, so that it
+	// round-robins with its peers and may be chosen again if nothing
+	// else at its priority or above is runnable.  If this CPU has
+	// nothing queued, steal from another CPU, and if there is nothing
+	// to steal either, halt.
+	struct Env *e;
+
+	if (curenv && curenv->env_status == ENV_RUNNABLE)
+		runq_insert(curenv);
+
+	if ((e = runq_pick()) != NULL) {
+		e->env_slice_left = e->env_slice;
+		env_run(e);
 	}
 
-	// Run the special idle environment when nothing else is runnable.
-	if (envs[0].env_status == ENV_RUNNABLE) {
-		last_run = 0;
-		env_run(&envs[0]);
+	// Nothing else to do, so zero some free pages for later
+	// page_alloc_zeroed() calls.
+	page_zero_fill();
+
+	sched_halt();
+}
+
+// Like sched_yield(), but run some other env if there is one, even of a
+// lower priority than curenv.  An env that yields because it waits for
+// another to make progress would otherwise be chosen again right away
+// whenever it has the highest priority, and never let the other run.
+void
+sched_yield_others(void)
+{
+	struct Env *e = runq_pick();
+
+	if (curenv && curenv->env_status == ENV_RUNNABLE)
+		runq_insert(curenv);
+	if (e) {
+		e->env_slice_left = e->env_slice;
+		env_run(e);
 	}
-	else {
+	sched_yield();
+}
+
+// Switch directly to e, which must be runnable, handing it the rest of
+// curenv's time slice; e.g. an IPC sender passes the CPU to the receiver
+// it just woke.  curenv goes back on the run queues if it is still
+// runnable.  Falls back to sched_yield() if e cannot run on this CPU
+// right now.
+void
+sched_yield_to(struct Env *e)
+{
+	if (e->env_status != ENV_RUNNABLE || ENV_RUNNING(e)
+	    || !(e->env_affinity & (1 << cpunum())))
+		sched_yield();
+
+	runq_remove(e);
+	if (curenv && curenv->env_status == ENV_RUNNABLE)
+		runq_insert(curenv);
+	e->env_slice_left = curenv ? curenv->env_slice_left : e->env_slice;
+	env_run(e);
+}
+
+// Halt this CPU when there is nothing to do, with its timer set up by
+// time_idle().  Wait until an interrupt wakes it up: a device, the timer
+// for the next sleeper's wakeup, or another CPU that queued work for it.
+// This function never returns.
+void
+sched_halt(void)
+{
+	int i;
+
+	// For debugging and testing purposes, if there are no runnable
+	// environments in the system, and none that will become runnable
+	// when their time comes, then drop into the kernel monitor.
+	for (i = 1; i < nenv; i++)
+		if (envs[i].env_status == ENV_RUNNABLE
+		    || envs[i].env_status == ENV_DYING)
+			break;
+	if (i == nenv && !time_pending()) {
 		cprintf("Destroyed all environments - nothing more to do!\n");
 		while (1)
 			monitor(NULL);
 	}
+
+	// Mark that no environment is running on this CPU
+	curenv = NULL;
+	lcr3(boot_cr3);
+
+	// Mark that this CPU is in the HALT state, so that when
+	// interrupts come in, we know we should re-acquire the
+	// big kernel lock and restart the timer
+	xchg(&thiscpu->cpu_status, CPU_HALTED);
+	time_idle();
+
+	// Release the big kernel lock as if we were "leaving" the kernel
+	unlock_kernel();
+
+	// Reset stack pointer, enable interrupts and then halt.
+	asm volatile (
+		"movl $0, %%ebp\n"
+		"movl %0, %%esp\n"
+		"pushl $0\n"
+		"pushl $0\n"
+		"sti\n"
+		"1:\n"
+		"hlt\n"
+		"jmp 1b\n"
+	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	panic("sched_halt: hlt loop returned");
 }
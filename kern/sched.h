@@ -6,7 +6,19 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
-// This function does not return.
+#include <inc/env.h>
+
+void sched_init(void);
+void sched_set_status(struct Env *e, unsigned status);
+void sched_set_priority(struct Env *e, uint32_t prio);
+void sched_set_affinity(struct Env *e, uint32_t mask);
+bool sched_need_resched(void);
+void sched_tick(void);
+
+// These functions do not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_yield_others(void) __attribute__((noreturn));
+void sched_yield_to(struct Env *e) __attribute__((noreturn));
+void sched_halt(void) __attribute__((noreturn));
 
 #endif	// !JOS_KERN_SCHED_H
@@ -13,20 +13,27 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e100.h>
+#include <kern/chan.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
 // Destroys the environment on memory errors.
-static void
+//
+// Returns 0, or -E_NO_MEM if [s, s+len) could not be faulted in.
+static int
 sys_cputs(const char *s, size_t len)
 {
+	int r;
+
 	// Check that the user has permission to read memory [s, s+len).
 	// Destroy the environment if not.
-	
+	if ((r = user_mem_fault_in(curenv, s, len, PTE_U)) < 0)
+		return r;
 	user_mem_assert(curenv, s, len, PTE_U);
 
 	// Print the string supplied by the user.
 	cprintf("%.*s", len, s);
+	return 0;
 }
 
 // Read a character from the system console without blocking.
@@ -61,11 +68,12 @@ sys_env_destroy(envid_t envid)
 	return 0;
 }
 
-// Deschedule current environment and pick a different one to run.
+// Deschedule current environment and pick a different one to run,
+// whatever its priority, if there is one.
 static void
 sys_yield(void)
 {
-	sched_yield();
+	sched_yield_others();
 }
 
 // Allocate a new environment.
@@ -85,15 +93,68 @@ sys_exofork(void)
 
 	if ((r = env_alloc(&env, curenv->env_id)) < 0)
 		return (envid_t) r; // error we have met
-	env->env_status = ENV_NOT_RUNNABLE;
+	sched_set_status(env, ENV_NOT_RUNNABLE);
+	env->env_tf = curenv->env_tf;
+	env->env_tf.tf_regs.reg_eax = 0; // return 0 in forked environment
+
+	return env->env_id;
+}
+
+// Fork curenv in the kernel.  The child is created as by sys_exofork,
+// but gets a copy-on-write copy of curenv's address space below UTOP
+// (see pgdir_copy_cow), the same page fault upcall, a fresh user
+// exception stack if curenv has one, and is marked runnable.
+// page_fault_handler resolves writes to the copy-on-write pages in both
+// environments without calling their upcalls.
+//
+// Returns envid of new environment in the parent and 0 in the child,
+// or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork_cow(void)
+{
+	struct Env *env;
+	struct Page *pp;
+	void *uxstack = (void *) (UXSTACKTOP - PGSIZE);
+	int r;
+
+	if ((r = env_alloc(&env, curenv->env_id)) < 0)
+		return r;
+	sched_set_status(env, ENV_NOT_RUNNABLE);
 	env->env_tf = curenv->env_tf;
 	env->env_tf.tf_regs.reg_eax = 0; // return 0 in forked environment
+	env->env_pgfault_upcall = curenv->env_pgfault_upcall;
+
+	if ((r = vm_copy(env, curenv)) < 0)
+		goto fail;
+	r = pgdir_copy_cow(env->env_pgdir, curenv->env_pgdir);
+	// Drop the write permission we took away from our own TLB.
+	lcr3(curenv->env_cr3);
+	if (r < 0)
+		goto fail;
+
+	if (page_lookup(curenv->env_pgdir, uxstack, NULL) != NULL) {
+		if ((r = page_alloc_zeroed(&pp)) < 0)
+			goto fail;
+		if ((r = page_insert(env->env_pgdir, pp, uxstack,
+				     PTE_U|PTE_W|PTE_P)) < 0) {
+			page_free(pp);
+			goto fail;
+		}
+	}
 
+	sched_set_status(env, ENV_RUNNABLE);
 	return env->env_id;
+
+fail:
+	env_free(env);
+	return r;
 }
 
 // Set envid's env_status to status, which must be ENV_RUNNABLE
-// or ENV_NOT_RUNNABLE.
+// or ENV_NOT_RUNNABLE.  Any wakeup envid had on the timer is canceled:
+// an env stopped this way stays stopped until it is made runnable.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
@@ -117,7 +178,8 @@ sys_env_set_status(envid_t envid, int status)
 
 	if ((r = envid2env(envid, &env, 1)) < 0)
 		return r;
-	env->env_status = status;
+	time_cancel(env);
+	sched_set_status(env, status);
 	return 0;
 }
 
@@ -129,6 +191,7 @@ sys_env_set_status(envid_t envid, int status)
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_FAULT if current environment has no access to tf given.
+//	-E_NO_MEM if there is no memory to fault tf in.
 static int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -141,6 +204,8 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	if ((r = envid2env(envid, &e, 1)) < 0)
 		return r;
 
+	if ((r = user_mem_fault_in(curenv, tf, sizeof(struct Trapframe), PTE_U)) < 0)
+		return r;
 	if ((r = user_mem_check(curenv, tf, sizeof(struct Trapframe), PTE_U|PTE_P)) < 0)
 		return r;
 
@@ -169,6 +234,72 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	return 0;
 }
 
+// Set envid's scheduling priority.  Runnable environments with a higher
+// priority always run before lower priority ones.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if prio is not between ENV_PRIO_MIN and ENV_PRIO_MAX.
+static int
+sys_env_set_priority(envid_t envid, uint32_t prio)
+{
+	struct Env *env;
+	int r;
+
+	if (prio > ENV_PRIO_MAX)
+		return -E_INVAL;
+	if ((r = envid2env(envid, &env, 1)) < 0)
+		return r;
+	sched_set_priority(env, prio);
+	return 0;
+}
+
+// Restrict envid to run only on the CPUs whose bits are set in cpumask.
+// An environment running on a CPU it is no longer allowed on moves the
+// next time it yields or is preempted.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpumask does not include any CPU that exists.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	struct Env *env;
+	int r;
+
+	if (!(cpumask & ((1 << ncpu) - 1)))
+		return -E_INVAL;
+	if ((r = envid2env(envid, &env, 1)) < 0)
+		return r;
+	sched_set_affinity(env, cpumask);
+	return 0;
+}
+
+// Set the length of envid's time slice, in timer ticks.  The timer
+// interrupt only preempts an environment once its slice is used up.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if ticks is 0.
+static int
+sys_env_set_slice(envid_t envid, uint32_t ticks)
+{
+	struct Env *env;
+	int r;
+
+	if (ticks == 0)
+		return -E_INVAL;
+	if ((r = envid2env(envid, &env, 1)) < 0)
+		return r;
+	env->env_slice = ticks;
+	if (env->env_slice_left > ticks)
+		env->env_slice_left = ticks;
+	return 0;
+}
+
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
 // The page's contents are set to 0.
@@ -177,18 +308,21 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_USER in inc/mmu.h.
+//         PTE_PS may also be set to allocate a 4MB page instead, which
+//         replaces everything mapped in [va, va+PTSIZE).
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
-//	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va >= UTOP, or va is not page-aligned (PTSIZE-aligned
+//		with PTE_PS).
 //	-E_INVAL if perm is inappropriate (see above).
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
 static int
 sys_page_alloc(envid_t envid, void *va, int perm)
 {
-	// Hint: This function is a wrapper around page_alloc() and
+	// Hint: This function is a wrapper around page_alloc_zeroed() and
 	//   page_insert() from kern/pmap.c.
 	//   Most of the new code you write should be to check the
 	//   parameters for correctness.
@@ -202,17 +336,23 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	// check va
 	if ((uint32_t) va >= UTOP || va != ROUNDUP(va, PGSIZE))
 		return -E_INVAL;
+	if ((perm & PTE_PS) && va != ROUNDUP(va, PTSIZE))
+		return -E_INVAL;
 	// check perm
-	if (perm & ~PTE_U & ~PTE_P & ~PTE_AVAIL & ~PTE_W)
+	if (perm & ~PTE_U & ~PTE_P & ~PTE_AVAIL & ~PTE_W & ~PTE_PS)
 		return -E_INVAL;
 	perm |= PTE_U | PTE_P;
 
 	if ((r = envid2env(envid, &env, 1)) < 0)
 		return r;
-	if ((r = page_alloc(&pp)) < 0) // allocate page
+	if (perm & PTE_PS) {
+		if ((r = page_alloc_order(PS_ORDER, &pp)) < 0)
+			return r;
+		memset(page2kva(pp), 0, PTSIZE);
+	} else if ((r = page_alloc_zeroed(&pp)) < 0) // allocate zeroed page
 		return r;
 	if ((r = page_insert(env->env_pgdir, pp, va, perm)) < 0) { // insert page
-		page_free(pp);
+		page_free_order(pp, pp->pp_order);
 		return r;
 	}
 	return 0;
@@ -233,6 +373,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva is in a 4MB page, which is mapped as a 4MB page
+//		at dstva too, but srcva or dstva is not PTSIZE-aligned.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
@@ -247,6 +389,7 @@ sys_page_map(envid_t srcenvid, void *srcva,
 
 	struct Env *src_env, *dst_env;
 	struct Page *pp;
+	pte_t *pte;
 	int r;
 
 	// check va
@@ -262,16 +405,21 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	if ((r = envid2env(dstenvid, &dst_env, 1)) < 0)
 		return r;
 
-	pp = page_lookup(src_env->env_pgdir, srcva, NULL);
+	pp = page_lookup(src_env->env_pgdir, srcva, &pte);
 	if (pp == NULL)
 		return -E_INVAL;
 
 	// check perm (PTE_W)
-	if ((perm & PTE_W)
-		&& !(*(pgdir_walk(src_env->env_pgdir, srcva, 0)) & PTE_W)) {
+	if ((perm & PTE_W) && !(*pte & PTE_W)) {
 		return -E_INVAL;
 	}
 
+	if (*pte & PTE_PS) {
+		if (srcva != ROUNDUP(srcva, PTSIZE) || dstva != ROUNDUP(dstva, PTSIZE))
+			return -E_INVAL;
+		perm |= PTE_PS;
+	}
+
 	if ((r = page_insert(dst_env->env_pgdir, pp, dstva, perm)) < 0)
 		return r;
 	return 0;
@@ -279,11 +427,14 @@ sys_page_map(envid_t srcenvid, void *srcva,
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
 // If no page is mapped, the function silently succeeds.
+// If va is in a 4MB page, the whole 4MB page is unmapped.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if va's page table is shared with another environment
+//		and there is no memory to give envid its own copy.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -299,10 +450,397 @@ sys_page_unmap(envid_t envid, void *va)
 	if ((r = envid2env(envid, &env, 1)) < 0)
 		return r;
 
-	page_remove(env->env_pgdir, va);
+	return page_remove(env->env_pgdir, va);
+}
+
+// The range system calls below do the work of npages calls of
+// sys_page_alloc, sys_page_map or sys_page_unmap in one trap.  If one of
+// them fails partway, it stops and returns the number of pages it got
+// through, so that the caller can resume from there; the retry then
+// reports the error.  Each returns:
+//	the number of pages done (npages on success),
+//	or < 0 if it failed on the very first page.
+
+// Check that [va, va + npages*PGSIZE) is page-aligned and below UTOP.
+static int
+page_range_check(void *va, size_t npages)
+{
+	if ((uint32_t) va >= UTOP || va != ROUNDUP(va, PGSIZE)
+	    || npages > (UTOP - (uint32_t) va) / PGSIZE)
+		return -E_INVAL;
 	return 0;
 }
 
+// The return value of a range system call that did 'done' pages and
+// then stopped with 'err' (or 0).
+static int
+page_range_result(size_t done, int err)
+{
+	return done == 0 && err < 0 ? err : done;
+}
+
+// Allocate npages pages at [va, va + npages*PGSIZE) in envid, as
+// sys_page_alloc does (without PTE_PS).
+//
+// Returns the number of pages done, as above.  Errors are those of
+// sys_page_alloc.
+static int
+sys_page_alloc_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	struct Env *env;
+	struct Page *pp;
+	size_t i;
+	int r;
+
+	if ((r = page_range_check(va, npages)) < 0)
+		return r;
+	if (perm & ~PTE_USER)
+		return -E_INVAL;
+	perm |= PTE_U | PTE_P;
+	if ((r = envid2env(envid, &env, 1)) < 0)
+		return r;
+
+	for (i = 0; i < npages; i++, va += PGSIZE) {
+		if ((r = page_alloc_zeroed(&pp)) < 0)
+			break;
+		if ((r = page_insert(env->env_pgdir, pp, va, perm)) < 0) {
+			page_free(pp);
+			break;
+		}
+	}
+	return page_range_result(i, r);
+}
+
+// Map each page mapped in [srcva, srcva + npages*PGSIZE) in srcenvid at
+// the same offset from dstva in dstenvid, as sys_page_map does.  Pages
+// that are not mapped in srcenvid are skipped, and whatever dstenvid
+// has mapped at their offset is left alone, so a whole region can be
+// copied in one call.  There are not enough registers for all six
+// arguments, so perm is passed in the low 12 bits of dstva.
+//
+// Returns the number of pages done, as above.  Errors are those of
+// sys_page_map, plus:
+//	-E_INVAL if a page in the source range is in a 4MB page.
+static int
+sys_page_map_range(envid_t srcenvid, void *srcva, envid_t dstenvid,
+		   uint32_t dstva_perm, size_t npages)
+{
+	struct Env *src_env, *dst_env;
+	struct Page *pp;
+	void *dstva = (void *) ROUNDDOWN(dstva_perm, PGSIZE);
+	int perm = PGOFF(dstva_perm);
+	void *va;
+	pte_t *pte;
+	size_t i;
+	int r;
+
+	if ((r = page_range_check(srcva, npages)) < 0
+	    || (r = page_range_check(dstva, npages)) < 0)
+		return r;
+	if (perm & ~PTE_USER)
+		return -E_INVAL;
+	if ((r = envid2env(srcenvid, &src_env, 1)) < 0)
+		return r;
+	if ((r = envid2env(dstenvid, &dst_env, 1)) < 0)
+		return r;
+
+	r = 0;
+	for (i = 0; i < npages; i++) {
+		va = srcva + i * PGSIZE;
+		if (!(src_env->env_pgdir[PDX(va)] & PTE_P)) {
+			// Skip the rest of a page table that is not there.
+			i += NPTENTRIES - PTX(va) - 1;
+			continue;
+		}
+		if ((pp = page_lookup(src_env->env_pgdir, va, &pte)) == NULL)
+			continue;
+		if ((*pte & PTE_PS) || ((perm & PTE_W) && !(*pte & PTE_W))) {
+			r = -E_INVAL;
+			break;
+		}
+		if ((r = page_insert(dst_env->env_pgdir, pp, dstva + i * PGSIZE,
+				     perm)) < 0)
+			break;
+	}
+	return page_range_result(r < 0 ? i : npages, r);
+}
+
+// Unmap [va, va + npages*PGSIZE) in envid, as sys_page_unmap does.
+//
+// Returns npages, or < 0 on error.  Errors are those of sys_page_unmap.
+static int
+sys_page_unmap_range(envid_t envid, void *va, size_t npages)
+{
+	struct Env *env;
+	void *start = va, *end;
+	int r;
+
+	if ((r = page_range_check(va, npages)) < 0)
+		return r;
+	if ((r = envid2env(envid, &env, 1)) < 0)
+		return r;
+
+	for (end = va + npages * PGSIZE; va < end; va += PGSIZE) {
+		if (!(env->env_pgdir[PDX(va)] & PTE_P))
+			va = ROUNDDOWN(va, PTSIZE) + PTSIZE - PGSIZE;
+		else if ((r = page_remove(env->env_pgdir, va)) < 0)
+			return page_range_result((va - start) / PGSIZE, r);
+	}
+	return npages;
+}
+
+// Reserve [va, va + len) in envid's address space as a demand-zero
+// region: the first touch of each page in it that has nothing mapped
+// maps a fresh zeroed page with permission 'perm', without calling the
+// page fault upcall.  So large bss and sparse heaps cost nothing until
+// they are used.  len is rounded up to a multiple of PGSIZE.  If len is
+// 0, the region starting at va is dropped instead; pages it already
+// mapped stay mapped.
+//
+// perm -- as for sys_page_alloc, but PTE_PS may not be set.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned, or the range does not fit
+//		below UTOP.
+//	-E_INVAL if perm is inappropriate (see above).
+//	-E_INVAL if the range overlaps a region envid already has, or
+//		len is 0 and no region starts at va.
+//	-E_NO_MEM if there is no memory to record the region.
+static int
+sys_vm_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	struct Env *env;
+	int r;
+
+	if (PGOFF(va) || (uintptr_t) va >= UTOP || len > UTOP - (uintptr_t) va)
+		return -E_INVAL;
+	if (perm & ~PTE_USER)
+		return -E_INVAL;
+	perm |= PTE_U | PTE_P;
+
+	if ((r = envid2env(envid, &env, 1)) < 0)
+		return r;
+	return vm_reserve(env, (uintptr_t) va, len, perm);
+}
+
+// Copy curenv's demand-zero regions (see sys_vm_reserve) into vrs[],
+// skipping the first 'skip' of them and copying at most n.  This lets
+// a user-level fork give its child the same regions.
+//
+// Returns the number of regions copied, which is less than n once there
+// are no more, or < 0 on error.  Errors are:
+//	-E_FAULT if vrs[] is not n writable Vm_regions.
+//	-E_NO_MEM if there is no memory to fault vrs[] in.
+static int
+sys_vm_regions(struct Vm_region *vrs, size_t skip, size_t n)
+{
+	struct Vm_area *vma;
+	size_t i = 0;
+	int r;
+
+	if (n > UTOP / sizeof(struct Vm_region))
+		return -E_FAULT;
+	if ((r = user_mem_fault_in(curenv, vrs, n * sizeof(struct Vm_region),
+				   PTE_U|PTE_W)) < 0)
+		return r;
+	if (user_mem_check(curenv, vrs, n * sizeof(struct Vm_region),
+			   PTE_U|PTE_W) < 0)
+		return -E_FAULT;
+	LIST_FOREACH(vma, &curenv->env_vmareas, vma_link) {
+		if (i >= skip + n)
+			break;
+		if (i >= skip)
+			vrs[i - skip] = vma->vma_region;
+		i++;
+	}
+	return i > skip ? i - skip : 0;
+}
+
+// Share curenv's page table for [va, va + PTSIZE) with envid, which
+// must have nothing mapped there yet.  The page table must map no
+// writable or copy-on-write pages; the two environments keep sharing it
+// until one of them changes a mapping in it, which gives that one its
+// own copy.  This lets a fork map the child's text a whole page table
+// at a time.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not PTSIZE-aligned.
+//	-E_INVAL if curenv has no shareable page table at va, or
+//		envid already has a page table or large page there.
+static int
+sys_pt_share(envid_t envid, void *va)
+{
+	struct Env *env;
+	int r;
+
+	if ((uintptr_t) va >= UTOP || (uintptr_t) va % PTSIZE)
+		return -E_INVAL;
+	if ((r = envid2env(envid, &env, 1)) < 0)
+		return r;
+	if (env == curenv || !pt_shareable(curenv->env_pgdir, va))
+		return -E_INVAL;
+	if (env->env_pgdir[PDX(va)] & PTE_P)
+		return -E_INVAL;
+	pt_share(env->env_pgdir, curenv->env_pgdir, va);
+	return 0;
+}
+
+// Check that src may send the page at srcva with permissions perm, as
+// described for sys_ipc_try_send below.  If srcva >= UTOP no page is
+// being sent and there is nothing to check.
+// Returns 0 and stores the page in *pp_store (NULL if no page) on
+// success, or -E_INVAL.
+static int
+ipc_check_page(struct Env *src, void *srcva, unsigned perm,
+	       struct Page **pp_store)
+{
+	struct Page *pp = NULL;
+	pte_t *pte;
+
+	if ((uint32_t) srcva < UTOP) {
+		if (srcva != ROUNDUP(srcva, PGSIZE))
+			return -E_INVAL;
+		if (perm & ~PTE_USER)
+			return -E_INVAL;
+		if ((pp = page_lookup(src->env_pgdir, srcva, &pte)) == NULL)
+			return -E_INVAL;
+		if ((perm & PTE_W) && !(*pte & PTE_W))
+			return -E_INVAL;
+		// Only single pages can be sent.
+		if (*pte & PTE_PS)
+			return -E_INVAL;
+	}
+	*pp_store = pp;
+	return 0;
+}
+
+// Copy the message e has just received out to e->env_ipc_batch[0], for
+// a sys_ipc_recv_batch that blocked.  e's address space need not be the
+// current one, so write through the kernel mapping of each page.  The
+// page was writable when e blocked; if e has since lost it, the message
+// is only left in the env_ipc_* fields.
+static void
+ipc_store_batch(struct Env *e)
+{
+	struct Ipc_msg m;
+	uintptr_t va = (uintptr_t) e->env_ipc_batch;
+	char *src = (char *) &m;
+	size_t len = sizeof(m), n, off;
+	pte_t *pte;
+
+	m.im_dstva = e->env_ipc_dstva;
+	m.im_from = e->env_ipc_from;
+	m.im_value = e->env_ipc_value;
+	m.im_perm = e->env_ipc_perm;
+	e->env_ipc_batch = NULL;
+
+	for (; len > 0; va += n, src += n, len -= n) {
+		n = MIN(len, PGSIZE - PGOFF(va));
+		if (!page_lookup(e->env_pgdir, (void *) va, &pte)
+		    || (*pte & (PTE_W|PTE_U)) != (PTE_W|PTE_U))
+			return;
+		off = (*pte & PTE_PS) ? (va & (PTSIZE - 1)) : PGOFF(va);
+		memmove(KADDR(PTE_ADDR(*pte)) + off, src, n);
+	}
+}
+
+// Deliver an IPC from src to dst, which must be receiving, as described
+// for sys_ipc_try_send below.  dst is only taken out of sys_ipc_recv once
+// every check has passed, so a failed send leaves it waiting.
+static int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value, void *srcva,
+	    unsigned perm)
+{
+	struct Page *pp;
+	int r;
+
+	assert(dst->env_ipc_recving);
+	if ((r = ipc_check_page(src, srcva, perm, &pp)) < 0)
+		return r;
+	if (pp == NULL || (uint32_t) dst->env_ipc_dstva >= UTOP)
+		perm = 0;
+	else if ((r = page_insert(dst->env_pgdir, pp, dst->env_ipc_dstva, perm)) < 0)
+		return r;
+
+	dst->env_ipc_recving = 0;
+	dst->env_ipc_value = value;
+	dst->env_ipc_from = src->env_id;
+	dst->env_ipc_perm = perm;
+	if (dst->env_ipc_batch != NULL)
+		ipc_store_batch(dst);
+	sched_set_status(dst, ENV_RUNNABLE);
+
+	return 0;
+}
+
+static void ipc_start_recv(struct Env *e, void *dstva);
+
+// e has just started receiving: hand it the message of the first sender
+// waiting on it, if any, and wake that sender.  A sender whose message
+// can no longer be delivered (e.g. it no longer has the page mapped) is
+// woken with the error instead, and the next one is tried.
+static void
+ipc_accept_sender(struct Env *e)
+{
+	struct Env *s;
+	int r;
+
+	while (e->env_ipc_recving
+	       && (s = TAILQ_FIRST(&e->env_ipc_senders)) != NULL) {
+		TAILQ_REMOVE(&e->env_ipc_senders, s, env_ipc_link);
+		s->env_ipc_link.tqe_prev = NULL;
+
+		r = ipc_deliver(s, e, s->env_ipc_send_value,
+				s->env_ipc_send_srcva, s->env_ipc_send_perm);
+		if (r == 0 && s->env_ipc_call) {
+			// s now waits for the reply, as in sys_ipc_call.
+			s->env_ipc_call = 0;
+			ipc_start_recv(s, s->env_ipc_dstva);
+		} else {
+			s->env_ipc_call = 0;
+			s->env_tf.tf_regs.reg_eax = r;
+			sched_set_status(s, ENV_RUNNABLE);
+		}
+	}
+}
+
+// Mark e as receiving at dstva, which has already been checked, and
+// block it.  The system call returns 0 once a sender wakes it up,
+// which may be right away if a sender was already waiting.
+static void
+ipc_start_recv(struct Env *e, void *dstva)
+{
+	e->env_ipc_dstva = dstva;
+	e->env_ipc_recving = 1;
+	sched_set_status(e, ENV_NOT_RUNNABLE);
+	e->env_tf.tf_regs.reg_eax = 0;
+	ipc_accept_sender(e);
+}
+
+// Block curenv on env's queue of senders with the message described by
+// the other arguments, which have already been checked.  If 'call' is
+// set, curenv starts receiving at dstva as soon as the message has been
+// delivered.  The system call returns 0, or an error if the send fails
+// later on.
+static void
+ipc_wait_send(struct Env *env, uint32_t value, void *srcva, unsigned perm,
+	      bool call, void *dstva)
+{
+	curenv->env_ipc_send_to = env->env_id;
+	curenv->env_ipc_send_value = value;
+	curenv->env_ipc_send_srcva = srcva;
+	curenv->env_ipc_send_perm = perm;
+	curenv->env_ipc_call = call;
+	curenv->env_ipc_dstva = dstva;
+	TAILQ_INSERT_TAIL(&env->env_ipc_senders, curenv, env_ipc_link);
+	sched_set_status(curenv, ENV_NOT_RUNNABLE);
+	curenv->env_tf.tf_regs.reg_eax = 0;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -339,46 +877,119 @@ sys_page_unmap(envid_t envid, void *va)
 //		address space.
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space.
+//	-E_INVAL if srcva is in a 4MB page.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	struct Env *env;
-	struct Page *pp;
 	int r;
 
 	if ((r = envid2env(envid, &env, 0)) < 0)
 		return r;
+	if (!env->env_ipc_recving)
+		return -E_IPC_NOT_RECV;
+	return ipc_deliver(curenv, env, value, srcva, perm);
+}
+
+// Like sys_ipc_try_send, but on success switch straight to the receiver,
+// donating the rest of the caller's time slice to it, instead of
+// returning to the caller.  The caller stays runnable and will see 0
+// returned when it is next scheduled.
+//
+// Returns < 0 on error, with the same errors as sys_ipc_try_send.
+static int
+sys_ipc_send_switch(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *env;
+	int r;
 
+	if ((r = envid2env(envid, &env, 0)) < 0)
+		return r;
 	if (!env->env_ipc_recving)
 		return -E_IPC_NOT_RECV;
-	env->env_ipc_recving = 0;
+	if ((r = ipc_deliver(curenv, env, value, srcva, perm)) < 0)
+		return r;
 
-	if ((uint32_t) srcva < UTOP) {
-		if (srcva != ROUNDUP(srcva, PGSIZE))
-			return -E_INVAL;
-		if (perm & ~PTE_USER)
-			return -E_INVAL;
-		if ((pp = page_lookup(curenv->env_pgdir, srcva, NULL)) == NULL)
-			return -E_INVAL;
-		if ((perm & PTE_W)
-			&& !(*(pgdir_walk(curenv->env_pgdir, srcva, 0)) & PTE_W))
-			return -E_INVAL;
-		if ((r = page_insert(env->env_pgdir, pp, env->env_ipc_dstva, perm)) < 0)
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield_to(env);
+}
+
+// Send an IPC to envid, blocking until it is received.
+// If envid is receiving, this is sys_ipc_send_switch.  Otherwise the
+// caller sleeps on envid's queue of waiting senders, which envid drains
+// in FIFO order each time it calls sys_ipc_recv.
+//
+// Returns 0 once the message has been delivered, < 0 on error.
+// Errors are those of sys_ipc_try_send, except for -E_IPC_NOT_RECV, plus:
+//	-E_INVAL if envid is the caller itself.
+//	-E_BAD_ENV if envid exits before receiving the message.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *env;
+	struct Page *pp;
+	int r;
+
+	if ((r = envid2env(envid, &env, 0)) < 0)
+		return r;
+	if (env == curenv)
+		return -E_INVAL;
+	if (env->env_ipc_recving) {
+		if ((r = ipc_deliver(curenv, env, value, srcva, perm)) < 0)
 			return r;
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		sched_yield_to(env);
 	}
-	env->env_ipc_value = value;
-	env->env_ipc_from = curenv->env_id;
-	env->env_ipc_perm = perm;
-	env->env_status = ENV_RUNNABLE;
 
-	return 0;
+	if ((r = ipc_check_page(curenv, srcva, perm, &pp)) < 0)
+		return r;
+	ipc_wait_send(env, value, srcva, perm, 0, NULL);
+	sched_yield();
+}
+
+// Send an IPC to envid and block receiving the reply in one system call,
+// for RPC-style clients.  The send is as in sys_ipc_send; then the
+// caller waits in sys_ipc_recv(dstva).  If envid was already receiving,
+// the CPU is handed directly to it so it can serve the request at once.
+// The reply comes back through the usual env_ipc_* fields.
+//
+// Returns 0 once the reply has arrived, < 0 on error.  Errors are those
+// of sys_ipc_send, plus:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+	struct Env *env;
+	struct Page *pp;
+	int r;
+
+	if ((uint32_t) dstva < UTOP && dstva != ROUNDUP(dstva, PGSIZE))
+		return -E_INVAL;
+	if ((r = envid2env(envid, &env, 0)) < 0)
+		return r;
+	if (env == curenv)
+		return -E_INVAL;
+	if (env->env_ipc_recving) {
+		if ((r = ipc_deliver(curenv, env, value, srcva, perm)) < 0)
+			return r;
+		ipc_start_recv(curenv, dstva);
+		sched_yield_to(env);
+	}
+
+	if ((r = ipc_check_page(curenv, srcva, perm, &pp)) < 0)
+		return r;
+	ipc_wait_send(env, value, srcva, perm, 1, dstva);
+	sched_yield();
 }
 
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
+// If a sender is already waiting in sys_ipc_send, take its message
+// and return at once.
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
@@ -390,23 +1001,133 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 static int
 sys_ipc_recv(void *dstva)
 {
-	if ((uint32_t) dstva < UTOP) {
-		// check sanity of dstva
-		if (dstva == ROUNDUP(dstva, PGSIZE))
-			curenv->env_ipc_dstva = dstva;
-		else
+	// check sanity of dstva
+	if ((uint32_t) dstva < UTOP && dstva != ROUNDUP(dstva, PGSIZE))
+		return -E_INVAL;
+
+	ipc_start_recv(curenv, dstva);
+	if (curenv->env_ipc_recving)
+		sched_yield();
+
+	return 0;
+}
+
+// Like sys_ipc_recv, but give up once time_msec() reaches 'msec', so
+// that a server can wait for a request or a deadline, whichever comes
+// first.
+//
+// Returns 0 once a message has arrived, < 0 on error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_TIMEOUT if no message arrived by then.
+static int
+sys_ipc_recv_until(void *dstva, unsigned int msec)
+{
+	if ((uint32_t) dstva < UTOP && dstva != ROUNDUP(dstva, PGSIZE))
+		return -E_INVAL;
+
+	ipc_start_recv(curenv, dstva);
+	if (!curenv->env_ipc_recving)
+		return 0;
+	if (time_wakeup_at(curenv, msec) < 0) {
+		curenv->env_ipc_recving = 0;
+		sched_set_status(curenv, ENV_RUNNABLE);
+		return -E_TIMEOUT;
+	}
+	sched_yield();
+}
+
+// Receive up to n messages in one system call, so that a busy server
+// pays one trap for a whole batch of requests.  msgs[i].im_dstva says
+// where the page sent with the i'th message may be mapped (>= UTOP for
+// nowhere, as for sys_ipc_recv); the sender, value and perm of that
+// message are stored in the rest of msgs[i].  Senders already waiting
+// in sys_ipc_send are taken in FIFO order.  If there are none, this
+// blocks exactly like sys_ipc_recv(msgs[0].im_dstva), and the one
+// message that wakes us up is stored in msgs[0] (as well as in the
+// env_ipc_* fields).
+//
+// Returns the number of messages stored in msgs[], which is at least 1.
+// Returns < 0 on error.  Errors are:
+//	-E_INVAL if n is not in [1, IPC_BATCH_MAX], or some im_dstva
+//		is < UTOP but not page-aligned, or its page overlaps
+//		msgs[0..n), which a page received there would replace.
+//	-E_FAULT if msgs[0..n) is not writable by curenv.
+//	-E_NO_MEM if there is no memory to fault msgs[0..n) in.
+static int
+sys_ipc_recv_batch(struct Ipc_msg *msgs, int n)
+{
+	uintptr_t start = (uintptr_t) msgs, end = start + n * sizeof(*msgs);
+	uintptr_t dstva;
+	struct Ipc_msg *m;
+	int i, r;
+
+	if (n <= 0 || n > IPC_BATCH_MAX)
+		return -E_INVAL;
+	if ((r = user_mem_fault_in(curenv, msgs, n * sizeof(*msgs),
+				   PTE_U|PTE_W)) < 0)
+		return r;
+	if (user_mem_check(curenv, msgs, n * sizeof(*msgs), PTE_U|PTE_W) < 0)
+		return -E_FAULT;
+	for (i = 0; i < n; i++) {
+		dstva = (uintptr_t) msgs[i].im_dstva;
+		if (dstva < UTOP
+		    && (PGOFF(dstva) || (dstva < end && start < dstva + PGSIZE)))
 			return -E_INVAL;
 	}
-	else {
-		curenv->env_ipc_dstva = NULL;
+
+	for (i = 0; i < n && !TAILQ_EMPTY(&curenv->env_ipc_senders); ) {
+		m = &msgs[i];
+		curenv->env_ipc_dstva = m->im_dstva;
+		curenv->env_ipc_recving = 1;
+		ipc_accept_sender(curenv);
+		if (curenv->env_ipc_recving)
+			break;		// every waiting sender failed
+		m->im_from = curenv->env_ipc_from;
+		m->im_value = curenv->env_ipc_value;
+		m->im_perm = curenv->env_ipc_perm;
+		i++;
 	}
-	curenv->env_ipc_recving = 1;
-	curenv->env_status = ENV_NOT_RUNNABLE;
-	curenv->env_tf.tf_regs.reg_eax = 0;
+	curenv->env_ipc_recving = 0;
+	if (i > 0)
+		return i;
 
-	sched_yield();
+	curenv->env_ipc_batch = msgs;
+	ipc_start_recv(curenv, msgs[0].im_dstva);
+	curenv->env_tf.tf_regs.reg_eax = 1;
+	if (curenv->env_ipc_recving)
+		sched_yield();
+	return 1;
+}
 
-	return 0;
+// Create a shared-memory channel to envid, mapping its two ring pages
+// at [va, va + 2*PGSIZE).  See chan_create() in kern/chan.c.
+static int
+sys_chan_create(envid_t envid, void *va)
+{
+	return chan_create(envid, va);
+}
+
+// Map the rings of channel id, created for us by its other end, at
+// [va, va + 2*PGSIZE).  See chan_attach() in kern/chan.c.
+static int
+sys_chan_attach(int id, void *va)
+{
+	return chan_attach(id, va);
+}
+
+// Wake the other end of channel id if it sleeps in sys_chan_wait.
+static int
+sys_chan_notify(int id)
+{
+	return chan_notify(id);
+}
+
+// Sleep until there is something to receive on channel id, or room to
+// send on it; see chan_wait().
+static int
+sys_chan_wait(int id, int what)
+{
+	return chan_wait(id, what);
 }
 
 // Return the current time.
@@ -416,6 +1137,36 @@ sys_time_msec(void)
 	return time_msec();
 }
 
+// Store the nanoseconds since boot, from time_nsec(), in *nsec.
+// Destroys the environment on memory errors.
+//
+// Returns 0, or -E_NO_MEM if *nsec could not be faulted in.
+static int
+sys_time_nsec(uint64_t *nsec)
+{
+	int r;
+
+	if ((r = user_mem_fault_in(curenv, nsec, sizeof(*nsec), PTE_U|PTE_W)) < 0)
+		return r;
+	user_mem_assert(curenv, nsec, sizeof(*nsec), PTE_U|PTE_W);
+	*nsec = time_nsec();
+	return 0;
+}
+
+// Block until time_msec() reaches 'msec'.  The caller is not runnable
+// meanwhile, so nothing has to poll the clock.
+//
+// Returns 0, right away if that time has already come.
+static int
+sys_sleep_until(unsigned int msec)
+{
+	if (time_wakeup_at(curenv, msec) < 0)
+		return 0;
+	sched_set_status(curenv, ENV_NOT_RUNNABLE);
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+}
+
 // Transmit a packet via e100
 static int
 sys_transmit(void *buffer, size_t len)
@@ -439,8 +1190,7 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// -E_INVAL if invalid system call number.
 	switch (syscallno) {
 	case SYS_cputs:
-		sys_cputs((const char *) a1, (size_t) a2);
-		return 0;
+		return sys_cputs((const char *) a1, (size_t) a2);
 	case SYS_cgetc:
 		return sys_cgetc();
 	case SYS_getenvid:
@@ -452,12 +1202,20 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		return 0;
 	case SYS_exofork:
 		return sys_exofork();
+	case SYS_fork_cow:
+		return sys_fork_cow();
 	case SYS_env_set_status:
 		return sys_env_set_status((envid_t) a1, (int) a2);
 	case SYS_env_set_trapframe:
 		return sys_env_set_trapframe((envid_t) a1, (struct Trapframe *) a2);
 	case SYS_env_set_pgfault_upcall:
 		return sys_env_set_pgfault_upcall((envid_t) a1, (void *) a2);
+	case SYS_env_set_priority:
+		return sys_env_set_priority((envid_t) a1, a2);
+	case SYS_env_set_slice:
+		return sys_env_set_slice((envid_t) a1, a2);
+	case SYS_env_set_affinity:
+		return sys_env_set_affinity((envid_t) a1, a2);
 	case SYS_page_alloc:
 		return sys_page_alloc((envid_t) a1, (void *) a2, (int) a3);
 	case SYS_page_map:
@@ -465,13 +1223,55 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			(void *) a4, (int) a5);
 	case SYS_page_unmap:
 		return sys_page_unmap((envid_t) a1, (void *) a2);
+	case SYS_page_alloc_range:
+		return sys_page_alloc_range((envid_t) a1, (void *) a2,
+			(size_t) a3, (int) a4);
+	case SYS_page_map_range:
+		return sys_page_map_range((envid_t) a1, (void *) a2,
+			(envid_t) a3, a4, (size_t) a5);
+	case SYS_page_unmap_range:
+		return sys_page_unmap_range((envid_t) a1, (void *) a2,
+			(size_t) a3);
+	case SYS_pt_share:
+		return sys_pt_share((envid_t) a1, (void *) a2);
+	case SYS_vm_reserve:
+		return sys_vm_reserve((envid_t) a1, (void *) a2, (size_t) a3,
+			(int) a4);
+	case SYS_vm_regions:
+		return sys_vm_regions((struct Vm_region *) a1, (size_t) a2,
+			(size_t) a3);
 	case SYS_ipc_try_send:
 		return sys_ipc_try_send((envid_t) a1, (uint32_t) a2, (void *) a3,
 			(unsigned int) a4);
 	case SYS_ipc_recv:
 		return sys_ipc_recv((void *) a1);
+	case SYS_ipc_send_switch:
+		return sys_ipc_send_switch((envid_t) a1, (uint32_t) a2,
+			(void *) a3, (unsigned) a4);
+	case SYS_ipc_send:
+		return sys_ipc_send((envid_t) a1, (uint32_t) a2, (void *) a3,
+			(unsigned) a4);
+	case SYS_chan_create:
+		return sys_chan_create((envid_t) a1, (void *) a2);
+	case SYS_chan_attach:
+		return sys_chan_attach((int) a1, (void *) a2);
+	case SYS_chan_notify:
+		return sys_chan_notify((int) a1);
+	case SYS_chan_wait:
+		return sys_chan_wait((int) a1, (int) a2);
+	case SYS_ipc_recv_batch:
+		return sys_ipc_recv_batch((struct Ipc_msg *) a1, (int) a2);
+	case SYS_ipc_call:
+		return sys_ipc_call((envid_t) a1, (uint32_t) a2, (void *) a3,
+			(unsigned) a4, (void *) a5);
 	case SYS_time_msec:
 		return sys_time_msec();
+	case SYS_sleep_until:
+		return sys_sleep_until((unsigned int) a1);
+	case SYS_ipc_recv_until:
+		return sys_ipc_recv_until((void *) a1, (unsigned int) a2);
+	case SYS_time_nsec:
+		return sys_time_nsec((uint64_t *) a1);
 	case SYS_transmit:
 		return sys_transmit((void *) a1, (size_t) a2);
 	case SYS_receive:
@@ -1,26 +1,251 @@
 #include <kern/time.h>
+#include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/kclock.h>
 #include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+#include <inc/trap.h>
+#include <inc/x86.h>
+
+// Slots in the timer wheel; a power of 2.
+#define TIMER_WHEEL_SIZE	256
 
 static unsigned int ticks;
+static uint64_t tick_tsc;		// TSC at the last tick
+
+// Set while every CPU is halted and CPU 0's timer is stopped or set to
+// fire only at the next wakeup; see time_idle().
+static bool tickless;
+
+// Mapped read-only at UTIME for every environment; set up by
+// i386_vm_init().
+struct Timepage *timepage;
+
+// Environments sleeping until tick t are on timer_wheel[t % TIMER_WHEEL_SIZE].
+// Each tick, time_tick() only looks at one slot and wakes the envs in it
+// whose tick has come; the others wait another turn of the wheel.
+static LIST_HEAD(Timer_slot, Env) timer_wheel[TIMER_WHEEL_SIZE];
+static uint32_t timer_nwaiting;		// Envs on the wheel
 
+// Measure the TSC frequency and start the clock.
 void
 time_init(void) 
 {
+	uint64_t tsc_hz;
+
 	ticks = 0;
+	tick_tsc = read_tsc();
+	timepage->tp_tsc = tick_tsc;
+	if ((tsc_hz = kclock_tsc_hz()) == 0) {
+		cprintf("time: cannot measure the TSC, using ticks\n");
+		return;
+	}
+	timepage->tp_tsc_per_msec = tsc_hz / 1000;
+	timepage->tp_tsc_mult = (1000000000ULL << TIMEPAGE_TSC_SHIFT) / tsc_hz;
+	cprintf("time: TSC runs at %u kHz\n", (uint32_t) (tsc_hz / 1000));
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
-void
-time_tick(void) 
+// e's time has come: wake it up.  If it was waiting for an IPC as well,
+// stop that and fail the system call with -E_TIMEOUT.
+static void
+time_expire(struct Env *e)
 {
+	if (e->env_ipc_recving) {
+		e->env_ipc_recving = 0;
+		e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+	}
+	sched_set_status(e, ENV_RUNNABLE);	// takes e off the wheel
+}
+
+// Advance the clock by one tick, which happened when the TSC read 'now'.
+static void
+time_tick_one(uint64_t now)
+{
+	struct Timer_slot *slot;
+	struct Env *e, *next;
+	uint64_t nsec;
+
+	tick_tsc = now;
 	ticks++;
 	if (ticks * 10 < ticks)
 		panic("time_tick: time overflowed");
+
+	if (timepage->tp_tsc_mult)
+		nsec = timepage_nsec(timepage, now);
+	else
+		nsec = (uint64_t) ticks * 10000000;
+
+	// Publish the new time to user space; see inc/time.h.
+	timepage->tp_seq++;
+	asm volatile("" ::: "memory");
+	timepage->tp_ticks = ticks;
+	timepage->tp_msec = nsec / 1000000;
+	timepage->tp_tsc = now;
+	timepage->tp_nsec = nsec;
+	asm volatile("" ::: "memory");
+	timepage->tp_seq++;
+
+	slot = &timer_wheel[ticks % TIMER_WHEEL_SIZE];
+	for (e = LIST_FIRST(slot); e; e = next) {
+		next = LIST_NEXT(e, env_timer_link);
+		if ((int32_t) (e->env_wakeup_tick - ticks) <= 0)
+			time_expire(e);
+	}
+}
+
+// This should be called once per timer interrupt on CPU 0.  A timer
+// interrupt fires every 10 ms, except while the system is idle; see
+// time_idle().
+void
+time_tick(void) 
+{
+	uint64_t now = read_tsc();
+	uint64_t tsc_per_tick = timepage->tp_tsc_per_msec * 10;
+
+	// If this interrupt is the one-shot timer that ended an idle
+	// period, time_resume() has already counted its tick.
+	if (tsc_per_tick && now - tick_tsc < tsc_per_tick / 2)
+		return;
+	time_tick_one(now);
+}
+
+// Return how many ticks from now the first env on the timer wheel is
+// due, or 0 if the wheel is empty.
+static uint32_t
+time_next_wakeup(void)
+{
+	struct Env *e;
+	uint32_t i, next = 0;
+	int32_t delta;
+
+	if (timer_nwaiting == 0)
+		return 0;
+	for (i = 0; i < TIMER_WHEEL_SIZE; i++)
+		LIST_FOREACH(e, &timer_wheel[i], env_timer_link) {
+			delta = MAX((int32_t) (e->env_wakeup_tick - ticks), 1);
+			if (next == 0 || delta < next)
+				next = delta;
+		}
+	return next;
+}
+
+// Called by sched_halt() just before this CPU halts with nothing to
+// run, so that an idle system is not woken 100 times a second for
+// nothing.  Other CPUs just stop their timers.  CPU 0, which keeps the
+// clock, goes tickless once all the others are halted: its timer then
+// only fires for the first wakeup on the timer wheel, if there is one,
+// and time_resume() makes up for the skipped ticks with the TSC.  Until
+// the TSC is calibrated, or while any other CPU runs and might look at
+// the clock, CPU 0 keeps ticking.  Without a local APIC, the PIT keeps
+// ticking regardless.
+void
+time_idle(void)
+{
+	uint32_t next;
+	int i;
+
+	if (!lapicaddr)
+		return;
+	if (cpunum() != 0) {
+		lapic_timer_stop();
+		return;
+	}
+	if (!timepage->tp_tsc_per_msec)
+		return;
+	for (i = 1; i < ncpu; i++)
+		if (cpus[i].cpu_status != CPU_HALTED)
+			return;
+
+	tickless = 1;
+	if ((next = time_next_wakeup()) != 0)
+		lapic_timer_oneshot(next);
+	else
+		lapic_timer_stop();
+}
+
+// Called by trap() when this CPU wakes up from sched_halt(), whatever
+// woke it, to undo time_idle(): restart the periodic timer and, on
+// CPU 0, catch up on the ticks it skipped, waking whoever they were
+// due for.  Another CPU that wakes while CPU 0 is tickless wakes CPU 0
+// too, so that the clock runs again while it is in use.
+void
+time_resume(void)
+{
+	uint64_t now, tsc_per_tick;
+
+	if (!lapicaddr)
+		return;
+	if (cpunum() != 0) {
+		lapic_timer_periodic();
+		if (tickless)
+			lapic_ipi_cpu(cpus[0].cpu_id, T_WAKEUP);
+		return;
+	}
+	if (!tickless)
+		return;
+
+	tickless = 0;
+	lapic_timer_periodic();
+	now = read_tsc();
+	tsc_per_tick = timepage->tp_tsc_per_msec * 10;
+	while (now - tick_tsc >= tsc_per_tick)
+		time_tick_one(tick_tsc + tsc_per_tick);
+}
+
+// Return whether any env is waiting on the timer wheel.
+bool
+time_pending(void)
+{
+	return timer_nwaiting != 0;
+}
+
+// Return the nanoseconds since boot.  Between ticks the time comes from
+// the TSC, so this has the TSC's resolution once it is calibrated.
+uint64_t
+time_nsec(void)
+{
+	return timepage_nsec(timepage, read_tsc());
 }
 
 unsigned int
 time_msec(void) 
 {
-	return ticks * 10;
+	return time_nsec() / 1000000;
+}
+
+// Arrange for e, which the caller blocks, to be woken up by time_tick()
+// once time_msec() reaches 'msec'.  The timer wheel only turns once a
+// tick, and the current tick is partly over, so e sleeps a whole tick
+// longer than it has to and may wake up to 10 ms late, but never early.
+// Whatever else e is waiting for should make it runnable first, which
+// cancels the wakeup.
+//
+// Returns 0 on success, or -E_TIMEOUT if that time has already come.
+int
+time_wakeup_at(struct Env *e, unsigned int msec)
+{
+	int32_t delta = msec - time_msec();
+	uint32_t tick;
+
+	if (delta <= 0)
+		return -E_TIMEOUT;
+	tick = ticks + 1 + delta / 10 + (delta % 10 != 0);
+	time_cancel(e);
+	e->env_wakeup_tick = tick;
+	LIST_INSERT_HEAD(&timer_wheel[tick % TIMER_WHEEL_SIZE], e,
+			 env_timer_link);
+	timer_nwaiting++;
+	return 0;
+}
+
+// Take e off the timer wheel, if it is on it.
+void
+time_cancel(struct Env *e)
+{
+	if (e->env_timer_link.le_prev) {
+		LIST_REMOVE(e, env_timer_link);
+		e->env_timer_link.le_prev = NULL;
+		timer_nwaiting--;
+	}
 }
@@ -4,8 +4,19 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/time.h>
+#include <inc/env.h>
+
+extern struct Timepage *timepage;
+
 void time_init(void);
 void time_tick(void); 
+uint64_t time_nsec(void);
 unsigned int time_msec(void);
+int time_wakeup_at(struct Env *e, unsigned int msec);
+void time_cancel(struct Env *e);
+bool time_pending(void);
+void time_idle(void);
+void time_resume(void);
 
 #endif /* JOS_KERN_TIME_H */
@@ -14,8 +14,8 @@
 #include <kern/picirq.h>
 #include <kern/time.h>
 #include <kern/e100.h>
-
-static struct Taskstate ts;
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 /* Interrupt descriptor table.  (Must be built at run time because
  * shifted function addresses can't be represented in relocation records.)
@@ -54,14 +54,18 @@ static const char *trapname(int trapno)
 		return excnames[trapno];
 	if (trapno == T_SYSCALL)
 		return "System call";
+	if (trapno == T_WAKEUP)
+		return "Wakeup IPI";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
 	return "(unknown trap)";
 }
 
 void HANDLER_SYSCALL();
+void HANDLER_WAKEUP();
 extern uint32_t trap_handlers[];
 extern uint32_t irq_handlers[];
+extern void sysenter_handler(void);
 
 void
 idt_init(void)
@@ -83,26 +87,53 @@ idt_init(void)
 	// system call
 	SETGATE(idt[T_SYSCALL], 0, GD_KT, HANDLER_SYSCALL, 3);
 
+	// wakeup IPI between CPUs
+	SETGATE(idt[T_WAKEUP], 0, GD_KT, HANDLER_WAKEUP, 0);
+
 	// hardware interrupt
 	for (i = IRQ_0; i <= IRQ_15; ++i) {
 		SETGATE(idt[IRQ_OFFSET + i], 0, GD_KT, irq_handlers[i], 3);
 	}
 
+	// Per-CPU setup
+	idt_init_percpu();
+}
+
+// Initialize and load the calling CPU's TSS and the IDT.  Each CPU has
+// its own TSS, and so its own kernel stack to trap onto; CPU i uses the
+// stack at KSTACKTOP - i * (KSTKSIZE + KSTKGAP) and gdt entry
+// (GD_TSS0 >> 3) + i.
+void
+idt_init_percpu(void)
+{
+	int i = cpunum();
+	struct Taskstate *ts = &thiscpu->cpu_ts;
+	uint32_t features;
+
 	// Setup a TSS so that we get the right stack
 	// when we trap to the kernel.
-	ts.ts_esp0 = KSTACKTOP;
-	ts.ts_ss0 = GD_KD;
+	ts->ts_esp0 = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+	ts->ts_ss0 = GD_KD;
 
 	// Initialize the TSS field of the gdt.
-	gdt[GD_TSS >> 3] = SEG16(STS_T32A, (uint32_t) (&ts),
+	gdt[(GD_TSS0 >> 3) + i] = SEG16(STS_T32A, (uint32_t) ts,
 					sizeof(struct Taskstate), 0);
-	gdt[GD_TSS >> 3].sd_s = 0;
+	gdt[(GD_TSS0 >> 3) + i].sd_s = 0;
 
 	// Load the TSS
-	ltr(GD_TSS);
+	ltr(GD_TSS0 + (i << 3));
 
 	// Load the IDT
 	asm volatile("lidt idt_pd");
+
+	// Let user mode make system calls with sysenter, if the CPU has
+	// it, entering at sysenter_handler on this CPU's kernel stack.
+	cpuid(1, NULL, NULL, NULL, &features);
+	if (features & CPUID_FEAT_SEP) {
+		wrmsr(MSR_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_SYSENTER_ESP, ts->ts_esp0);
+		wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_handler);
+	}
 }
 
 void
@@ -160,13 +191,21 @@ trap_dispatch(struct Trapframe *tf)
 		print_trapframe(tf);
 		return;
 	case IRQ_OFFSET + IRQ_TIMER:
-		// Handle clock interrupts
-		time_tick();
-		sched_yield();
+		// Handle clock interrupts.  Every CPU gets its own tick for
+		// scheduling, but only the boot CPU advances the clock.
+		lapic_eoi();
+		if (cpunum() == 0)
+			time_tick();
+		sched_tick();
 		return;
 	case T_SYSCALL:
 		system_call_handler(tf);
 		return;
+	case T_WAKEUP:
+		// Another CPU gave this one work or a new deadline; trap()
+		// reschedules on the way out.
+		lapic_eoi();
+		return;
 	case T_PGFLT:
 		page_fault_handler(tf);
 		return;
@@ -197,12 +236,36 @@ trap(struct Trapframe *tf)
 	// the interrupt path.
 	assert(!(read_eflags() & FL_IF));
 
+	// Re-acquire the big kernel lock if we were halted in
+	// sched_halt(), and restart the timer that it stopped.
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED) {
+		lock_kernel();
+		time_resume();
+	}
+
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
+		// Acquire the big kernel lock before doing any
+		// serious kernel work.
 		// Copy trap frame (which is currently on the stack)
 		// into 'curenv->env_tf', so that running the environment
 		// will restart at the trap point.
+		uint64_t now;
+
+		lock_kernel();
 		assert(curenv);
+
+		// Garbage collect if current environment was destroyed
+		// while it was running on this CPU.
+		if (curenv->env_status == ENV_DYING) {
+			env_free(curenv);
+			curenv = NULL;
+			sched_yield();
+		}
+
+		now = read_tsc();
+		curenv->env_utime += now - curenv->env_tsc;
+		curenv->env_tsc = now;
 		curenv->env_tf = *tf;
 		// The trapframe on the stack should be ignored from here on.
 		tf = &curenv->env_tf;
@@ -213,8 +276,9 @@ trap(struct Trapframe *tf)
 
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
-	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNABLE)
+	// if doing so makes sense, unless the trap woke up a higher
+	// priority environment.
+	if (curenv && curenv->env_status == ENV_RUNNABLE && !sched_need_resched())
 		env_run(curenv);
 	else
 		sched_yield();
@@ -241,6 +305,16 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// Writes to copy-on-write pages are resolved right here, without
+	// a round trip through the page fault upcall.
+	if ((tf->tf_err & (FEC_PR|FEC_WR)) == (FEC_PR|FEC_WR)
+	    && page_cow_break(curenv->env_pgdir, (void *) fault_va) == 0)
+		return;
+	// So are first touches of demand-zero pages.
+	if (!(tf->tf_err & FEC_PR)
+	    && vm_demand_zero(curenv, (void *) fault_va) == 0)
+		return;
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -284,6 +358,9 @@ page_fault_handler(struct Trapframe *tf)
 		}
 
 		// make sure exception stack is allocated and pgfault_upcall is valid
+		// (if there is no memory to fault the stack in, the assertion
+		// destroys the environment)
+		user_mem_fault_in(curenv, (void *) dst, size, PTE_U|PTE_W);
 		user_mem_assert(curenv, (void *) dst, size, PTE_P|PTE_U|PTE_W);
 		user_mem_assert(curenv, curenv->env_pgfault_upcall, sizeof(void *),
 			PTE_P|PTE_U);
@@ -324,3 +401,53 @@ system_call_handler(struct Trapframe *tf)
 		regs->reg_ebx, regs->reg_edi, regs->reg_esi);
 	regs->reg_eax = ret;
 }
+
+// Handle a system call made with sysenter.  sysenter_handler (see
+// kern/trapentry.S) calls this on the kernel stack with a Trapframe
+// that still lacks the user's %eip and %esp: lib/syscall.c leaves its
+// %esp in %ebp, with the return address on top.
+//
+// Works like trap() does for int $T_SYSCALL, and also leaves through
+// env_run() or sched_yield() if the system call blocked or something
+// more important is runnable.  In the common case, it returns the
+// Trapframe for sysenter_handler to return to user mode with sysexit.
+struct Trapframe *
+sysenter_trap(struct Trapframe *tf)
+{
+	uint32_t *ustack = (uint32_t *) tf->tf_regs.reg_ebp;
+	uint64_t now;
+
+	asm volatile("cld" ::: "cc");
+	lock_kernel();
+	assert(curenv);
+
+	if (curenv->env_status == ENV_DYING) {
+		env_free(curenv);
+		curenv = NULL;
+		sched_yield();
+	}
+
+	now = read_tsc();
+	curenv->env_utime += now - curenv->env_tsc;
+	curenv->env_tsc = now;
+
+	// Complete the Trapframe, so that curenv can be resumed from
+	// env_tf like after int $T_SYSCALL if it blocks or is forked.
+	user_mem_assert(curenv, ustack, sizeof(uint32_t), PTE_U);
+	tf->tf_eip = ustack[0];
+	tf->tf_esp = (uintptr_t) (ustack + 1);
+	tf->tf_eflags |= FL_IF;
+	curenv->env_tf = *tf;
+	tf = &curenv->env_tf;
+
+	system_call_handler(tf);
+
+	if (curenv && curenv->env_status == ENV_RUNNABLE && !sched_need_resched()) {
+		now = read_tsc();
+		curenv->env_ktime += now - curenv->env_tsc;
+		curenv->env_tsc = now;
+		unlock_kernel();
+		return tf;
+	}
+	sched_yield();
+}
@@ -0,0 +1,130 @@
+// User-level channel library: lock-free single-producer/single-consumer
+// message rings in memory shared by two environments (see inc/chan.h).
+//
+// Sending and receiving only copy messages in and out of the rings.
+// The kernel is only entered to sleep when there is nothing to receive
+// or no room to send, and to wake up the other end when it did so.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// Keep the compiler from moving memory accesses across this point.
+// x86 itself does not reorder stores with other stores or loads with
+// other loads, so this is enough to publish and consume messages.
+#define barrier()	asm volatile("" ::: "memory")
+
+// Create a channel to 'peer', mapping its rings at [va, va + 2*PGSIZE),
+// and fill in *ch.  The peer needs the returned channel id, e.g. sent
+// over IPC, to chan_attach() to it.
+// Returns the channel id on success, < 0 on error.
+int
+chan_create(envid_t peer, void *va, struct Chan *ch)
+{
+	int id;
+
+	if ((id = sys_chan_create(peer, va)) < 0)
+		return id;
+	ch->ch_id = id;
+	ch->ch_tx = (struct Chan_ring *) va;
+	ch->ch_rx = (struct Chan_ring *) (va + PGSIZE);
+	return id;
+}
+
+// Attach to channel 'id', which another environment created for us,
+// mapping its rings at [va, va + 2*PGSIZE), and fill in *ch.
+// Returns 0 on success, < 0 on error.
+int
+chan_attach(int id, void *va, struct Chan *ch)
+{
+	int r;
+
+	if ((r = sys_chan_attach(id, va)) < 0)
+		return r;
+	ch->ch_id = id;
+	ch->ch_tx = (struct Chan_ring *) va;
+	ch->ch_rx = (struct Chan_ring *) (va + PGSIZE);
+	return 0;
+}
+
+// Send message *m on ch, sleeping in the kernel while the ring is full.
+// Only traps into the kernel then, or if the consumer has gone to sleep.
+// Returns 0 on success, < 0 if the other end has gone away, which is
+// only noticed when we trap.
+int
+chan_send(struct Chan *ch, const struct Chan_msg *m)
+{
+	struct Chan_ring *r = ch->ch_tx;
+	uint32_t tail = r->cr_tail;
+	int err;
+
+	while (tail - r->cr_head == CHAN_NSLOT) {
+		// Tell the consumer we are going to sleep, then check again
+		// so that room made meanwhile is not missed.
+		xchg(&r->cr_blocked, 1);
+		err = 0;
+		if (tail - r->cr_head == CHAN_NSLOT)
+			err = sys_chan_wait(ch->ch_id, CHAN_WAIT_SEND);
+		r->cr_blocked = 0;
+		if (err < 0)
+			return err;
+	}
+	r->cr_msgs[tail % CHAN_NSLOT] = *m;
+	barrier();
+
+	// Publish the message.  xchg is a full barrier, so the consumer
+	// either sees the new tail before it sleeps or we see it asleep.
+	xchg(&r->cr_tail, tail + 1);
+	if (r->cr_sleeping)
+		return sys_chan_notify(ch->ch_id);
+	return 0;
+}
+
+// Copy up to n waiting messages from ch into msgs[] without blocking.
+// Only traps into the kernel to wake the producer if it is asleep on a
+// full ring.
+// Returns the number of messages received, which may be 0.
+int
+chan_poll(struct Chan *ch, struct Chan_msg *msgs, int n)
+{
+	struct Chan_ring *r = ch->ch_rx;
+	uint32_t head = r->cr_head, tail = r->cr_tail;
+	int i;
+
+	barrier();
+	for (i = 0; i < n && head != tail; i++, head++)
+		msgs[i] = r->cr_msgs[head % CHAN_NSLOT];
+	if (i == 0)
+		return 0;
+
+	// Free the slots.  As in chan_send(), xchg makes sure that either
+	// the producer sees them before it sleeps or we see it asleep.
+	barrier();
+	xchg(&r->cr_head, head);
+	if (r->cr_blocked)
+		sys_chan_notify(ch->ch_id);
+	return i;
+}
+
+// Copy up to n messages from ch into msgs[], sleeping in the kernel
+// until at least one has arrived.  A server can drain a whole batch of
+// requests per wakeup this way.
+// Returns the number of messages received, < 0 on error.
+int
+chan_recv(struct Chan *ch, struct Chan_msg *msgs, int n)
+{
+	struct Chan_ring *r = ch->ch_rx;
+	int nrecv, err;
+
+	while ((nrecv = chan_poll(ch, msgs, n)) == 0 && n > 0) {
+		// Tell the producer we are going to sleep, then check again
+		// so that a message sent meanwhile is not missed.
+		xchg(&r->cr_sleeping, 1);
+		err = 0;
+		if (r->cr_head == r->cr_tail)
+			err = sys_chan_wait(ch->ch_id, CHAN_WAIT_RECV);
+		r->cr_sleeping = 0;
+		if (err < 0)
+			return err;
+	}
+	return nrecv;
+}
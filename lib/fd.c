@@ -77,13 +77,13 @@ fd_lookup(int fdnum, struct Fd **fd_store)
 
 	if (fdnum < 0 || fdnum >= MAXFD) {
 		if (debug)
-			cprintf("[%08x] bad fd %d\n", env->env_id, fd);
+			cprintf("[%08x] bad fd %d\n", thisenv->env_id, fd);
 		return -E_INVAL;
 	}
 	fd = INDEX2FD(fdnum);
 	if (!(vpd[PDX(fd)] & PTE_P) || !(vpt[VPN(fd)] & PTE_P)) {
 		if (debug)
-			cprintf("[%08x] closed fd %d\n", env->env_id, fd);
+			cprintf("[%08x] closed fd %d\n", thisenv->env_id, fd);
 		return -E_INVAL;
 	}
 	*fd_store = fd;
@@ -139,7 +139,7 @@ dev_lookup(int dev_id, struct Dev **dev)
 			*dev = devtab[i];
 			return 0;
 		}
-	cprintf("[%08x] unknown device type %d\n", env->env_id, dev_id);
+	cprintf("[%08x] unknown device type %d\n", thisenv->env_id, dev_id);
 	*dev = 0;
 	return -E_INVAL;
 }
@@ -210,7 +210,7 @@ read(int fdnum, void *buf, size_t n)
 	    || (r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
 		return r;
 	if ((fd->fd_omode & O_ACCMODE) == O_WRONLY) {
-		cprintf("[%08x] read %d -- bad mode\n", env->env_id, fdnum); 
+		cprintf("[%08x] read %d -- bad mode\n", thisenv->env_id, fdnum); 
 		return -E_INVAL;
 	}
 	if (!dev->dev_read)
@@ -244,7 +244,7 @@ write(int fdnum, const void *buf, size_t n)
 	    || (r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
 		return r;
 	if ((fd->fd_omode & O_ACCMODE) == O_RDONLY) {
-		cprintf("[%08x] write %d -- bad mode\n", env->env_id, fdnum);
+		cprintf("[%08x] write %d -- bad mode\n", thisenv->env_id, fdnum);
 		return -E_INVAL;
 	}
 	if (debug)
@@ -278,7 +278,7 @@ ftruncate(int fdnum, off_t newsize)
 		return r;
 	if ((fd->fd_omode & O_ACCMODE) == O_RDONLY) {
 		cprintf("[%08x] ftruncate %d -- bad mode\n",
-			env->env_id, fdnum); 
+			thisenv->env_id, fdnum); 
 		return -E_INVAL;
 	}
 	if (!dev->dev_trunc)
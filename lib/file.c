@@ -16,10 +16,10 @@ static int
 fsipc(unsigned type, void *dstva)
 {
 	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", env->env_id, type, *(uint32_t *)&fsipcbuf);
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(envs[1].env_id, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(envs[1].env_id, type, &fsipcbuf, PTE_P | PTE_W | PTE_U,
+			dstva, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -78,7 +78,7 @@ open(const char *path, int mode)
 		return r;
 
 	// allocate a page for fd
-	if ((r = sys_page_alloc(env->env_id, fd, PTE_U|PTE_W|PTE_P)) < 0) {
+	if ((r = sys_page_alloc(thisenv->env_id, fd, PTE_U|PTE_W|PTE_P)) < 0) {
 		fd_close(fd, 0);
 		return r;
 	}
@@ -181,6 +181,32 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 	return fsipc(FSREQ_SET_SIZE, NULL);
 }
 
+// Map the page of file 'fdnum' that starts at byte 'offset' at va,
+// read-only.
+// The page is the file server's own block cache page, so everyone who
+// maps it shares the same physical memory, until the file server next
+// writes to that block and takes a copy of its own.
+//
+// Returns:
+//	0 on success.
+//	-E_INVAL if fdnum is not an open file, or offset is not
+//		page-aligned or is past its end.
+//	< 0 for other errors.
+int
+read_map(int fdnum, off_t offset, void *va)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = offset;
+	return fsipc(FSREQ_MAP, va);
+}
+
 // Delete a file
 int
 remove(const char *path)
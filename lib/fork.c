@@ -3,117 +3,183 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
+//
+// Return the permissions with which fork() maps our page at va into the
+// child: the same if the page is PTE_SHARE, copy-on-write if the page is
+// writable or copy-on-write, read-only otherwise.  Returns 0 if the page
+// is not to be mapped at all.
+//
+static int
+dupperm(uintptr_t va)
+{
+	pte_t pt_entry;
+
+	if (va == UXSTACKTOP - PGSIZE)
+		return 0;
+	pt_entry = vpt[VPN(va)];
+	if (!(pt_entry & PTE_P))
+		return 0;
+	if (pt_entry & PTE_SHARE)
+		return pt_entry & PTE_USER;
+	if (pt_entry & (PTE_W|PTE_COW))
+		return PTE_COW|PTE_U|PTE_P;
+	return PTE_U|PTE_P;
+}
 
 //
-// Custom page fault handler - if faulting page is copy-on-write,
-// map in our own private writable copy.
+// Return true if va is in the normal user stack area, which sfork()
+// does not share.
+//
+static bool
+in_stack(uintptr_t va)
+{
+	return va >= USTACKTOP - PTSIZE && va < USTACKTOP;
+}
+
+//
+// Return the permissions with which sfork() maps our page at va into the
+// child.  The stack is copy-on-write as for fork(); every other page is
+// shared with the same permissions.  A copy-on-write page is first made
+// our own by writing to it, or a write by either thread would give it a
+// private copy.  Returns 0 if the page is not to be mapped at all.
+//
+static int
+sharedperm(uintptr_t va)
+{
+	if (in_stack(va))
+		return dupperm(va);
+	if (va == UXSTACKTOP - PGSIZE || !(vpt[VPN(va)] & PTE_P))
+		return 0;
+	if (vpt[VPN(va)] & PTE_COW)
+		*(volatile uint32_t *) va = *(volatile uint32_t *) va;
+	return vpt[VPN(va)] & PTE_USER;
+}
+
+//
+// Return true if our page table for the 4MB region at va maps no
+// writable or copy-on-write pages, so fork() can share the whole table
+// with the child instead of mapping its pages one by one.
+//
+static bool
+pt_readonly(uintptr_t va)
+{
+	uintptr_t p;
+
+	for (p = va; p < va + PTSIZE; p += PGSIZE)
+		if ((vpt[VPN(p)] & PTE_P) && (vpt[VPN(p)] & (PTE_W|PTE_COW)))
+			return 0;
+	return 1;
+}
+
+//
+// Map our 4MB page at va, which has no page table to look at in vpt,
+// into the child envid as a whole.  It gets the permissions dupperm()
+// or sharedperm() would give a small page there: copy-on-write in both
+// of us if it is writable, unless it is PTE_SHARE or sfork() shares it.
 //
 static void
-pgfault(struct UTrapframe *utf)
+duplarge(envid_t envid, uintptr_t va, bool shared)
 {
-	void *addr = (void *) utf->utf_fault_va;
-	uint32_t err = utf->utf_err;
-	int r;
+	int perm, r;
 
-	// Check that the faulting access was (1) a write, and (2) to a
-	// copy-on-write page.  If not, panic.
-	// Hint:
-	//   Use the read-only page table mappings at vpt
-	//   (see <inc/memlayout.h>).
+	shared = shared && !in_stack(va);
+	if (shared && (vpd[PDX(va)] & PTE_COW))
+		*(volatile uint32_t *) va = *(volatile uint32_t *) va;
+	perm = vpd[PDX(va)] & PTE_USER;
+	if (!shared && !(perm & PTE_SHARE) && (perm & (PTE_W|PTE_COW)))
+		perm = (perm & ~PTE_W) | PTE_COW;
 
-	if (!((err & FEC_WR) && (vpt[VPN(addr)] & PTE_COW))) {
-		cprintf("virtual address: %08x, %d, %d\n", addr, err & FEC_WR, vpt[VPN(addr)] & PTE_COW);
-		panic("unrecoverable user page fault");
-	}
+	if ((r = sys_page_map(0, (void *) va, envid, (void *) va, perm)) < 0)
+		panic("cannot duplicate 4MB page at %08x: %e", va, r);
+	if ((perm & PTE_COW)
+	    && (r = sys_page_map(0, (void *) va, 0, (void *) va, perm)) < 0)
+		panic("cannot remap 4MB page at %08x: %e", va, r);
+}
 
-	// Allocate a new page, map it at a temporary location (PFTEMP),
-	// copy the data from the old page to the new page, then move the new
-	// page to the old page's address.
-	// Hint:
-	//   You should make three system calls.
-	//   No need to explicitly delete the old page's mapping.
+//
+// Give the child our demand-zero regions (see sys_vm_reserve), so that
+// it finds zeroes wherever we have not touched them yet either.
+// Threads must see the same pages, though, so for sfork() we first
+// fault in the pages of our regions outside the stack, which are then
+// shared like all the others.
+//
+static void
+dupregions(envid_t envid, bool shared)
+{
+	struct Vm_region vrs[8], *vr;
+	uintptr_t va;
+	size_t skip;
+	int n, r;
 
-	if ((r = sys_page_alloc(0, PFTEMP, PTE_W|PTE_U|PTE_P)) < 0) {
-		cprintf("sys_page_alloc() error: %e\n", r);
-		panic("cannot alloc page");
-	}
-	memmove((void *) PFTEMP, ROUNDDOWN(addr, PGSIZE), PGSIZE);
-	if ((r = sys_page_map(0, (void *) PFTEMP,
-		0, ROUNDDOWN(addr, PGSIZE), PTE_W|PTE_U|PTE_P)) < 0) {
-		cprintf("sys_page_map() error: %e\n", r);
-		panic("cannot map page");
-	}
-	if ((r = sys_page_unmap(0, (void *) PFTEMP)) < 0) {
-		cprintf("sys_page_unmap() error: %e\n", r);
-		panic("cannot unmap page");
-	}
+	for (skip = 0; (n = sys_vm_regions(vrs, skip, 8)) > 0; skip += n)
+		for (vr = vrs; vr < vrs + n; vr++) {
+			if (shared && !in_stack(vr->vr_start))
+				for (va = vr->vr_start;
+				     va < vr->vr_start + vr->vr_len; va += PGSIZE)
+					(void) *(volatile uint8_t *) va;
+			if ((r = sys_vm_reserve(envid, (void *) vr->vr_start,
+						vr->vr_len, vr->vr_perm)) < 0)
+				panic("cannot reserve region at %08x: %e",
+				      vr->vr_start, r);
+		}
 }
 
 //
-// Map our virtual page pn (address pn*PGSIZE) into the target envid
-// at the same virtual address.  If the page is writable or copy-on-write,
-// the new mapping must be created copy-on-write, and then our mapping must be
-// marked copy-on-write as well.  (Exercise: Why do we need to mark ours
-// copy-on-write again if it was already copy-on-write at the beginning of
-// this function?)
+// Map our pages [va, end) into the target envid at the same virtual
+// addresses with permissions perm.  If the pages are to be copy-on-write,
+// then our mappings must be marked copy-on-write as well.  (Exercise: Why
+// do we need to mark ours copy-on-write again if they were already
+// copy-on-write at the beginning of this function?)
+//
+// Each sys_page_map_range call maps as many pages as it can, so keep
+// going from wherever it stopped.
 //
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
-// 
+//
 static int
-duppage(envid_t envid, unsigned pn)
+duprange(envid_t envid, uintptr_t va, uintptr_t end, int perm)
 {
-	int r, perm;
-	pte_t pt_entry;
-
-	pt_entry = vpt[pn];
+	uintptr_t p;
+	int r;
 
-	// find permissions
-	if (pt_entry & (PTE_W|PTE_COW))
-		perm = PTE_COW|PTE_U|PTE_P;
-	else
-		perm = PTE_U|PTE_P;
-
-	// duplicate mapping at envid
-	if ((r = sys_page_map(0, (void *) (pn * PGSIZE),
-		envid, (void *) (pn * PGSIZE), perm)) < 0) {
-		panic("cannot duplicate mapping at %08x\n", pn * PGSIZE);
-	}
+	// duplicate mappings at envid
+	for (p = va; p < end; p += r * PGSIZE)
+		if ((r = sys_page_map_range(0, (void *) p, envid, (void *) p,
+					    (end - p) / PGSIZE, perm)) < 0)
+			panic("cannot duplicate mapping at %08x: %e", p, r);
 
 	// if map as copy-on-write, remap with different perm
 	if (perm & PTE_COW)
-		if ((r = sys_page_map(0, (void *) (pn * PGSIZE),
-			0, (void *) (pn * PGSIZE), perm)) < 0)
-			panic("cannot remap at %08x\n", pn * PGSIZE);
+		for (p = va; p < end; p += r * PGSIZE)
+			if ((r = sys_page_map_range(0, (void *) p, 0, (void *) p,
+						    (end - p) / PGSIZE, perm)) < 0)
+				panic("cannot remap at %08x: %e", p, r);
 	return 0;
 }
 
 //
-// User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
-// Create a child.
-// Copy our address space and page fault handler setup to the child.
+// Create a child with a copy of our address space: copy-on-write, or
+// shared but for the stack if 'shared' is set (see sharedperm).
+// Copy our page fault handler setup to the child.
 // Then mark the child as runnable and return.
 //
+// There is no copy-on-write page fault handler here: the kernel's page
+// fault handler gives whoever writes to a PTE_COW page, small or 4MB,
+// its own copy before any upcall runs (see page_cow_break).
+//
 // Returns: child's envid to the parent, 0 to the child, < 0 on error.
 // It is also OK to panic on error.
 //
-// Hint:
-//   Use vpd, vpt, and duppage.
-//   Remember to fix "env" in the child process.
-//   Neither user exception stack should ever be marked copy-on-write,
-//   so you must allocate a new page for the child's user exception stack.
+// Neither user exception stack should ever be marked copy-on-write or
+// shared, so the child gets a new page for its user exception stack.
 //
-envid_t
-fork(void)
+static envid_t
+dofork(bool shared)
 {
-	int r;
-	unsigned int pd_idx, pt_idx, va;
+	int r, perm, run_perm;
+	uintptr_t va, next, run_start, run_end;
 	envid_t child_id;
-	set_pgfault_handler(pgfault);
 
 	child_id = sys_exofork();
 
@@ -122,37 +188,104 @@ fork(void)
 	}
 	else if (child_id > 0) {
 		// parent
-		for (pd_idx = 0; pd_idx < PDX(UTOP); ++pd_idx) {
-			if (vpd[pd_idx] & PTE_P) {
-				for (pt_idx = 0; pt_idx < NPTENTRIES; ++pt_idx) {
-					va = (pd_idx << PDXSHIFT) + (pt_idx << PTXSHIFT);
-					if (va != UXSTACKTOP - PGSIZE) {
-						if (vpt[VPN(va)] & PTE_P) {
-							duppage(child_id, VPN(va));
-						}
-					}
-				}
+		dupregions(child_id, shared);
+
+		// Copy our mappings a run of pages with the same
+		// permissions at a time, to keep the number of system
+		// calls down.
+		run_start = run_end = 0;
+		run_perm = 0;
+		for (va = 0; va < UTOP; va = next) {
+			next = va + PGSIZE;
+			perm = 0;
+			if (vpd[PDX(va)] & PTE_PS) {
+				duplarge(child_id, va, shared);
+				next = va + PTSIZE;
+			} else if (!(vpd[PDX(va)] & PTE_P))
+				next = va + PTSIZE;
+			else if (va % PTSIZE == 0 && pt_readonly(va)) {
+				// Read-only page tables, such as those of
+				// our text, are shared with the child whole.
+				if ((r = sys_pt_share(child_id, (void *) va)) < 0)
+					panic("cannot share page table at %08x: %e", va, r);
+				next = va + PTSIZE;
+			} else
+				perm = shared ? sharedperm(va) : dupperm(va);
+
+			if (perm && perm == run_perm && va == run_end) {
+				run_end = next;
+				continue;
 			}
+			if (run_perm)
+				duprange(child_id, run_start, run_end, run_perm);
+			run_start = va;
+			run_end = next;
+			run_perm = perm;
 		}
+		if (run_perm)
+			duprange(child_id, run_start, run_end, run_perm);
+
 		if ((r = sys_page_alloc(child_id, (void *) (UXSTACKTOP - PGSIZE), PTE_U|PTE_W|PTE_P)) < 0)
 			panic("cannot allocate user exception stack");
-		if ((r = sys_env_set_pgfault_upcall(child_id, env->env_pgfault_upcall)) < 0)
+		if ((r = sys_env_set_pgfault_upcall(child_id, thisenv->env_pgfault_upcall)) < 0)
 			panic("cannot set page fault upcall for child");
 		if ((r = sys_env_set_status(child_id, ENV_RUNNABLE)) < 0)
 			panic("cannot set child as runnable");
 	}
 	else {
 		// child
-		env = &envs[ENVX(sys_getenvid())];
+		thisenv = &envs[ENVX(sys_getenvid())];
 		return 0;
 	}
 	return child_id;
 }
 
-// Challenge!
-int
+//
+// User-level fork with copy-on-write.  The address space is copied here,
+// but copy-on-write faults are still resolved by the kernel.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
+ufork(void)
+{
+	return dofork(0);
+}
+
+//
+// Fork with copy-on-write done by the kernel (see sys_fork_cow), which
+// clones the address space in one system call and resolves copy-on-write
+// faults without a page fault upcall.  Falls back to the user-level
+// ufork() only if the kernel has no sys_fork_cow (-E_INVAL, as for any
+// unknown system call, or -E_NOT_SUPP); other errors, such as running
+// out of environments or memory, are returned.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
+fork(void)
+{
+	envid_t child_id;
+
+	child_id = sys_fork_cow();
+	if (child_id == -E_INVAL || child_id == -E_NOT_SUPP)
+		return ufork();
+	if (child_id < 0)
+		return child_id;
+	if (child_id == 0)
+		thisenv = &envs[ENVX(sys_getenvid())];
+	return child_id;
+}
+
+//
+// Create a thread: a child that shares all our memory except for the
+// stack and user exception stack, which it gets its own copies of.
+// Each side still finds its own Env in thisenv, which lives on the stack.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	return dofork(1);
 }
@@ -2,6 +2,24 @@
 
 #include <inc/lib.h>
 
+// Finish an ipc_recv whose system call returned r.
+static int32_t
+ipc_recv_result(int r, envid_t *from_env_store, int *perm_store)
+{
+	if (r < 0) {
+		if (from_env_store != NULL)
+			*from_env_store = 0;
+		if (perm_store != NULL)
+			*perm_store = 0;
+		return r;
+	}
+	if (from_env_store != NULL)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store != NULL)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
 //	that address.
@@ -15,7 +33,7 @@
 // Otherwise, return the value sent by the sender
 //
 // Hint:
-//   Use 'env' to discover the value and who sent it.
+//   Use 'thisenv' to discover the value and who sent it.
 //   If 'pg' is null, pass sys_ipc_recv a value that it will understand
 //   as meaning "no page".  (Zero is not the right value, since that's
 //   a perfectly valid place to map a page.)
@@ -28,40 +46,94 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	else
 		r = sys_ipc_recv(pg);
 
-	if (r < 0) {
-		if (from_env_store != NULL)
-			*from_env_store = 0;
-		if (perm_store != NULL)
-			*perm_store = 0;
-		return r;
-	}
-	if (from_env_store != NULL)
-		*from_env_store = env->env_ipc_from;
-	if (perm_store != NULL)
-		*perm_store = env->env_ipc_perm;
-	return env->env_ipc_value;
+	return ipc_recv_result(r, from_env_store, perm_store);
+}
+
+// Like ipc_recv, but give up and return -E_TIMEOUT if nothing has
+// arrived by the time time_msec() reaches 'msec'.
+int32_t
+ipc_recv_until(envid_t *from_env_store, void *pg, int *perm_store,
+	       unsigned int msec)
+{
+	int r;
+
+	if (pg == NULL)
+		r = sys_ipc_recv_until((void *) 0xffffffff, msec);
+	else
+		r = sys_ipc_recv_until(pg, msec);
+
+	return ipc_recv_result(r, from_env_store, perm_store);
+}
+
+// Receive between 1 and n messages via IPC, blocking until there is at
+// least one, and return how many were stored in msgs[].  The caller
+// fills in msgs[i].im_dstva with the address at which to map a page sent
+// with the i'th message, or NULL to accept no page; the sender, value and
+// perm of each message are filled in as for ipc_recv().
+// Returns < 0 if the system call fails.
+int
+ipc_recv_batch(struct Ipc_msg *msgs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (msgs[i].im_dstva == NULL)
+			msgs[i].im_dstva = (void *) 0xffffffff;
+	return sys_ipc_recv_batch(msgs, n);
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function blocks in the kernel until 'toenv' receives the message;
+// senders are served in the order they arrive.  It panics on any error.
 //
-// Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_recv a value that it will understand
-//   as meaning "no page".  (Zero is not the right value.)
+// If 'pg' is null, pass a value that the kernel will understand
+// as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
 	int r;
-	do {
-		if (pg == NULL)
-			r = sys_ipc_try_send(to_env, val, (void *) 0xffffffff, perm);
-		else
-			r = sys_ipc_try_send(to_env, val, pg, perm);
-		sys_yield();
-	} while (r == -E_IPC_NOT_RECV);
 
-	if (r < 0)
+	if (pg == NULL)
+		pg = (void *) 0xffffffff;
+	if ((r = sys_ipc_send(to_env, val, pg, perm)) < 0)
 		panic("IPC send error: %e, env: %d", r, to_env);
 }
+
+// Like ipc_send, but if 'to_env' is already receiving, deliver the
+// message and keep running instead of handing 'to_env' the CPU.
+// For servers answering several requests in a row: only the last
+// reply should give the CPU away.
+void
+ipc_reply(envid_t to_env, uint32_t val, void *pg, int perm)
+{
+	int r;
+
+	if (pg == NULL)
+		pg = (void *) 0xffffffff;
+	if ((r = sys_ipc_try_send(to_env, val, pg, perm)) == -E_IPC_NOT_RECV)
+		r = sys_ipc_send(to_env, val, pg, perm);
+	if (r < 0)
+		panic("IPC reply error: %e, env: %d", r, to_env);
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env' and
+// wait for its reply, as ipc_send() followed by ipc_recv(), but in a
+// single system call that switches straight to 'to_env'.
+// 'rcv_pg' and 'perm_store' are as for ipc_recv().
+// Returns the value of the reply.  Panics on any error.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if (pg == NULL)
+		pg = (void *) 0xffffffff;
+	if (rcv_pg == NULL)
+		rcv_pg = (void *) 0xffffffff;
+	if ((r = sys_ipc_call(to_env, val, pg, perm, rcv_pg)) < 0)
+		panic("IPC call error: %e, env: %d", r, to_env);
+	if (perm_store != NULL)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
@@ -5,14 +5,13 @@
 
 extern void umain(int argc, char **argv);
 
-volatile struct Env *env;
 char *binaryname = "(PROGRAM NAME UNKNOWN)";
 
 void
 libmain(int argc, char **argv)
 {
-	// set env to point at our env structure in envs[].
-	env = envs + ENVX(sys_getenvid());
+	// set thisenv to point at our env structure in envs[].
+	thisenv = envs + ENVX(sys_getenvid());
 
 	// save the name of the program so that panic() can use it
 	if (argc > 0)
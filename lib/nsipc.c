@@ -17,10 +17,10 @@ static int
 nsipc(unsigned type)
 {
 	if (debug)
-		cprintf("[%08x] nsipc %d\n", env->env_id, type);
+		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(envs[2].env_id, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-	return ipc_recv(NULL, NULL, NULL);
+	return ipc_call(envs[2].env_id, type, &nsipcbuf, PTE_P|PTE_W|PTE_U,
+			NULL, NULL);
 }
 
 int
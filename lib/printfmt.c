@@ -36,6 +36,7 @@ static const char * const error_string[MAXERROR + 1] =
 	"file already exists",
 	"file is not a valid executable",
 	"operation not supported",
+	"timed out",
 };
 
 /*
@@ -48,13 +48,13 @@ spawn(const char *prog, const char **argv)
 	//
 	//	* If the ELF flags do not include ELF_PROG_FLAG_WRITE,
 	//	  then the segment contains text and read-only data.
-	//	  Use read_map() to read the contents of this segment,
-	//	  and map the pages it returns directly into the child
-	//        so that multiple instances of the same program
+	//	  Use read_map() to map the file server's block cache
+	//	  pages for this segment, and map them directly into the
+	//	  child so that multiple instances of the same program
 	//	  will share the same copy of the program text.
+	//	  The file server breaks that sharing if the program is
+	//	  written to later, so running instances keep their text.
 	//        Be sure to map the program text read-only in the child.
-	//        Read_map is like read but returns a pointer to the data in
-	//        *blk rather than copying the data into another buffer.
 	//
 	//	* If the ELF segment flags DO include ELF_PROG_FLAG_WRITE,
 	//	  then the segment contains read/write data and bss.
@@ -62,15 +62,13 @@ spawn(const char *prog, const char **argv)
 	//	  occupies p_memsz bytes in memory, but only the FIRST
 	//	  p_filesz bytes of the segment are actually loaded
 	//	  from the executable file - you must clear the rest to zero.
-	//        For each page to be mapped for a read/write segment,
-	//        allocate a page in the parent temporarily at UTEMP,
-	//        read() the appropriate portion of the file into that page
-	//	  and/or use memset() to zero non-loaded portions.
-	//	  (You can avoid calling memset(), if you like, if
-	//	  page_alloc() returns zeroed pages already.)
-	//        Then insert the page mapping into the child.
-	//        Look at init_stack() for inspiration.
-	//        Be sure you understand why you can't use read_map() here.
+	//	  Whole pages of data are mapped from the block cache as
+	//	  for text, but copy-on-write, so that the child only gets
+	//	  its own copy of a page when it first writes to it.
+	//	  The page holding the end of the data, if it is followed
+	//	  by bss, is read() into a fresh page instead, and bss
+	//	  is reserved to be zero-filled on demand (sys_vm_reserve).
+	//	  Look at init_stack() for inspiration.
 	//
 	//     Note: None of the segment addresses or lengths above
 	//     are guaranteed to be page-aligned, so you must deal with
@@ -171,8 +169,10 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 	// Set up pointers into the temporary page 'UTEMP'; we'll map a page
 	// there later, then remap that page into the child environment
 	// at (USTACKTOP - PGSIZE).
-	// strings is the topmost thing on the stack.
-	string_store = (char*) UTEMP + PGSIZE - string_size;
+	// strings is the topmost thing on the stack, below the word
+	// reserved for thisenv (see inc/lib.h).
+	string_store = (char*) UTEMP + PGSIZE - (USTACKTOP - USTACKENV)
+		- string_size;
 	// argv is below that.  There's one argument pointer per argument, plus
 	// a null pointer.
 	argv_store = (uintptr_t*) (ROUNDDOWN(string_store, 4) - 4 * (argc + 1));
@@ -209,7 +209,7 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 		string_store += strlen(argv[i]) + 1;
 	}
 	argv_store[argc] = 0;
-	assert(string_store == (char*)UTEMP + PGSIZE);
+	assert(string_store == (char*) UTEMP + PGSIZE - (USTACKTOP - USTACKENV));
 
 	argv_store[-1] = UTEMP2USTACK(argv_store);
 	argv_store[-2] = argc;
@@ -230,12 +230,24 @@ error:
 	return r;
 }
 
+// Allocate npages blank pages at va in envid, resuming
+// sys_page_alloc_range wherever it stops short.
+static int
+alloc_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	int r;
+
+	for (; npages > 0; va += r * PGSIZE, npages -= r)
+		if ((r = sys_page_alloc_range(envid, va, npages, perm)) < 0)
+			return r;
+	return 0;
+}
+
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz, 
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
-	void *blk;
+	int i, j, n, r, mapsz, mapperm;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -246,24 +258,51 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = read(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
-		}
+	// Map the pages backed by the file straight from the file server's
+	// block cache, but for a partial last page that has to be followed
+	// by zeroes.  Writable ones are copy-on-write, so the child's own
+	// copy is only made when it writes to the page.  Block cache pages
+	// start at page-aligned file offsets, so a segment whose file offset
+	// is not page-aligned in the same way as its va is read() instead.
+	if (PGOFF(fileoffset) != 0)
+		mapsz = 0;
+	else if (memsz > filesz)
+		mapsz = ROUNDDOWN(filesz, PGSIZE);
+	else
+		mapsz = ROUNDUP(filesz, PGSIZE);
+	mapperm = (perm & PTE_W) ? (perm & ~PTE_W) | PTE_COW : perm;
+	for (i = 0; i < mapsz; i += PGSIZE) {
+		if ((r = read_map(fd, fileoffset + i, UTEMP)) < 0)
+			return r;
+		if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i),
+				      mapperm)) < 0)
+			return r;
 	}
+	sys_page_unmap(0, UTEMP);
+
+	// Read the rest into fresh pages at UTEMP, as many as fit below
+	// PFTEMP at a time, and move them to the child.
+	for (i = mapsz; i < filesz; i += n * PGSIZE) {
+		n = MIN(ROUNDUP(filesz - i, PGSIZE), PFTEMP - UTEMP) / PGSIZE;
+		if ((r = alloc_range(0, UTEMP, n, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		if ((r = seek(fd, fileoffset + i)) < 0)
+			return r;
+		if ((r = readn(fd, UTEMP, MIN(n * PGSIZE, filesz - i))) < 0)
+			return r;
+		for (j = 0; j < n; j += r)
+			if ((r = sys_page_map_range(0, UTEMP + j * PGSIZE, child,
+					(void*) (va + i + j * PGSIZE), n - j, perm)) < 0)
+				panic("spawn: sys_page_map_range data: %e", r);
+		sys_page_unmap_range(0, UTEMP, n);
+	}
+
+	// leave the rest to be filled with zeroes on demand
+	i = ROUNDUP(filesz, PGSIZE);
+	if (i < memsz
+	    && (r = sys_vm_reserve(child, (void*) (va + i), memsz - i,
+				   perm)) < 0)
+		return r;
 	return 0;
 }
 
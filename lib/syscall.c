@@ -2,6 +2,25 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+// Whether to enter the kernel with sysenter rather than int $T_SYSCALL:
+// 1 if the CPU has it, 0 if not, -1 until the first system call finds out.
+static int use_sysenter = -1;
+
+static int
+sysenter_supported(void)
+{
+	uint32_t eax, edx, family, model;
+
+	cpuid(1, &eax, NULL, NULL, &edx);
+	family = (eax >> 8) & 0xf;
+	model = (eax >> 4) & 0xf;
+	// The Pentium Pro claims SEP, but has no working sysenter.
+	if (family == 6 && model < 3 && (eax & 0xf) < 3)
+		return 0;
+	return (edx & CPUID_FEAT_SEP) != 0;
+}
 
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -19,17 +38,40 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// The last clause tells the assembler that this can
 	// potentially change the condition codes and arbitrary
 	// memory locations.
+	//
+	// With sysenter, the registers are the same, but the kernel
+	// also needs to know where to return to: push the return
+	// address and pass %esp in BP (see sysenter_handler in
+	// kern/trapentry.S).  sysexit clobbers DX and CX.
 
-	asm volatile("int %1\n"
-		: "=a" (ret)
-		: "i" (T_SYSCALL),
-		  "a" (num),
-		  "d" (a1),
-		  "c" (a2),
-		  "b" (a3),
-		  "D" (a4),
-		  "S" (a5)
-		: "cc", "memory");
+	if (use_sysenter < 0)
+		use_sysenter = sysenter_supported();
+
+	if (use_sysenter)
+		asm volatile("pushl %%ebp\n"
+			"\tpushl $1f\n"
+			"\tmovl %%esp, %%ebp\n"
+			"\tsysenter\n"
+			"1:\tpopl %%ebp\n"
+			: "=a" (ret),
+			  "+d" (a1),
+			  "+c" (a2)
+			: "a" (num),
+			  "b" (a3),
+			  "D" (a4),
+			  "S" (a5)
+			: "cc", "memory");
+	else
+		asm volatile("int %1\n"
+			: "=a" (ret)
+			: "i" (T_SYSCALL),
+			  "a" (num),
+			  "d" (a1),
+			  "c" (a2),
+			  "b" (a3),
+			  "D" (a4),
+			  "S" (a5)
+			: "cc", "memory");
 	
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
@@ -85,8 +127,56 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_alloc_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	return syscall(SYS_page_alloc_range, 0, envid, (uint32_t) va, npages, perm, 0);
+}
+
+// The kernel takes perm in the low bits of dstva, since a page-aligned
+// dstva does not need them.
+int
+sys_page_map_range(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva,
+		   size_t npages, int perm)
+{
+	if (PGOFF(dstva))
+		return -E_INVAL;
+	return syscall(SYS_page_map_range, 0, srcenv, (uint32_t) srcva, dstenv,
+		       (uint32_t) dstva | (perm & 0xFFF), npages);
+}
+
+int
+sys_page_unmap_range(envid_t envid, void *va, size_t npages)
+{
+	return syscall(SYS_page_unmap_range, 0, envid, (uint32_t) va, npages, 0, 0);
+}
+
+int
+sys_pt_share(envid_t envid, void *va)
+{
+	return syscall(SYS_pt_share, 0, envid, (uint32_t) va, 0, 0, 0);
+}
+
+int
+sys_vm_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_vm_reserve, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
+int
+sys_vm_regions(struct Vm_region *vrs, size_t skip, size_t n)
+{
+	return syscall(SYS_vm_regions, 0, (uint32_t) vrs, skip, n, 0, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork_cow(void)
+{
+	return syscall(SYS_fork_cow, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -105,6 +195,24 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 	return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uint32_t) upcall, 0, 0, 0);
 }
 
+int
+sys_env_set_priority(envid_t envid, uint32_t prio)
+{
+	return syscall(SYS_env_set_priority, 1, envid, prio, 0, 0, 0);
+}
+
+int
+sys_env_set_slice(envid_t envid, uint32_t ticks)
+{
+	return syscall(SYS_env_set_slice, 1, envid, ticks, 0, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, cpumask, 0, 0, 0);
+}
+
 int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 {
@@ -117,12 +225,78 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_send_switch(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send_switch, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_recv_batch(struct Ipc_msg *msgs, int n)
+{
+	return syscall(SYS_ipc_recv_batch, 0, (uint32_t) msgs, n, 0, 0, 0);
+}
+
+int
+sys_chan_create(envid_t envid, void *va)
+{
+	return syscall(SYS_chan_create, 0, envid, (uint32_t) va, 0, 0, 0);
+}
+
+int
+sys_chan_attach(int id, void *va)
+{
+	return syscall(SYS_chan_attach, 1, id, (uint32_t) va, 0, 0, 0);
+}
+
+int
+sys_chan_notify(int id)
+{
+	return syscall(SYS_chan_notify, 1, id, 0, 0, 0, 0);
+}
+
+int
+sys_chan_wait(int id, int what)
+{
+	return syscall(SYS_chan_wait, 1, id, what, 0, 0, 0);
+}
+
 unsigned int
 sys_time_msec(void)
 {
 	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
 }
 
+int
+sys_sleep_until(unsigned int msec)
+{
+	return syscall(SYS_sleep_until, 0, msec, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_recv_until(void *dstva, unsigned int msec)
+{
+	return syscall(SYS_ipc_recv_until, 1, (uint32_t) dstva, msec, 0, 0, 0);
+}
+
+int
+sys_time_nsec(uint64_t *nsec)
+{
+	return syscall(SYS_time_nsec, 0, (uint32_t) nsec, 0, 0, 0, 0);
+}
+
 int
 sys_transmit(void *buffer, size_t len)
 {
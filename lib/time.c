@@ -0,0 +1,47 @@
+// Read the kernel's clock from the time page at UTIME, which the kernel
+// updates on every timer tick, without a system call.  Between ticks,
+// the TSC supplies the nanoseconds.  See inc/time.h.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// Keep the compiler from moving the reads of the page across tp_seq.
+#define barrier()	asm volatile("" ::: "memory")
+
+// Copy a consistent snapshot of the time page into *tp.
+void
+timepage_read(struct Timepage *tp)
+{
+	uint32_t seq;
+
+	do {
+		while ((seq = timepage.tp_seq) & 1)
+			;
+		barrier();
+		tp->tp_ticks = timepage.tp_ticks;
+		tp->tp_msec = timepage.tp_msec;
+		tp->tp_tsc_mult = timepage.tp_tsc_mult;
+		tp->tp_tsc = timepage.tp_tsc;
+		tp->tp_tsc_per_msec = timepage.tp_tsc_per_msec;
+		tp->tp_nsec = timepage.tp_nsec;
+		barrier();
+	} while (timepage.tp_seq != seq);
+	tp->tp_seq = seq;
+}
+
+// Return the nanoseconds since boot, like sys_time_nsec().
+uint64_t
+time_nsec(void)
+{
+	struct Timepage tp;
+
+	timepage_read(&tp);
+	return timepage_nsec(&tp, read_tsc());
+}
+
+// Return the milliseconds since boot, like sys_time_msec().
+unsigned int
+time_msec(void)
+{
+	return time_nsec() / 1000000;
+}
@@ -15,7 +15,12 @@ input(envid_t ns_envid)
 	// reading from it for a while, so don't immediately receive
 	// another packet in to the same physical page.
 
-	int len;
+	int len, r;
+
+	// The e100 interrupt that wakes us from sys_receive() is only
+	// delivered to CPU 0.
+	if ((r = sys_env_set_affinity(0, 1 << 0)) < 0)
+		panic("sys_env_set_affinity: %e", r);
 
 	while (1) {
 		sys_page_alloc(0, &nsipcbuf, PTE_P|PTE_U|PTE_W);
@@ -171,6 +171,7 @@ sys_arch_sem_wait(sys_sem_t sem, u32_t tm_msec)
 {
     assert(!sems[sem].freed);
     u32_t waited = 0;
+    uint64_t start = time_nsec();
 
     int gen = sems[sem].gen;
 
@@ -181,8 +182,7 @@ sys_arch_sem_wait(sys_sem_t sem, u32_t tm_msec)
  	} else if (tm_msec == SYS_ARCH_NOWAIT) {
 	    return SYS_ARCH_TIMEOUT;
 	} else {
-	    uint32_t a = sys_time_msec();
-	    uint32_t sleep_until = tm_msec ? a + (tm_msec - waited) : ~0;
+	    uint32_t sleep_until = tm_msec ? time_msec() + (tm_msec - waited) : ~0;
 	    sems[sem].waiters = 1;
 	    uint32_t cur_v = sems[sem].v;
 	    lwip_core_unlock();
@@ -192,8 +192,9 @@ sys_arch_sem_wait(sys_sem_t sem, u32_t tm_msec)
 		cprintf("sys_arch_sem_wait: sem freed under waiter!\n");
 		return SYS_ARCH_TIMEOUT;
 	    }
-	    uint32_t b = sys_time_msec();
-	    waited += (b - a);
+	    // Measure from the start in ns, so that rounding every
+	    // wakeup to ms does not add up.
+	    waited = (time_nsec() - start) / 1000000;
 	}
     }
 
@@ -10,6 +10,8 @@
 // Virtual address at which to receive page mappings containing client requests.
 #define QUEUE_SIZE	20
 #define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
+// Most requests to receive with one system call.
+#define NS_BATCH	8
 
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
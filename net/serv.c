@@ -70,6 +70,16 @@ get_buffer(void) {
 	return va;
 }
 
+static int
+free_buffers(void) {
+	int i, n = 0;
+
+	for (i = 0; i < QUEUE_SIZE; i++)
+		if (!buse[i])
+			n++;
+	return n;
+}
+
 static void
 put_buffer(void *va) {
 	int i = ((uint32_t)va - REQVA) / PGSIZE;
@@ -99,15 +109,18 @@ static void __attribute__((noreturn))
 net_timer(uint32_t arg)
 {
 	struct timer_thread *t = (struct timer_thread *) arg;
+	uint64_t next = time_nsec();
 
+	// Keep the deadlines in ns, so that the period does not drift by
+	// rounding to ms every round.
 	for (;;) {
-		uint32_t cur = sys_time_msec();
+		next += (uint64_t) t->msec * 1000000;
 
 		lwip_core_lock();
 		t->func();
 		lwip_core_unlock();
 
-		thread_wait(0, 0, cur + t->msec);
+		thread_wait(0, 0, (next + 999999) / 1000000);
 	}
 }
 
@@ -162,18 +175,17 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 
 static void
 process_timer(envid_t envid) {
-	uint32_t start, now, to;
+	uint64_t start;
+	uint32_t to;
 
 	if (envid != timer_envid) {
 		cprintf("NS: received timer interrupt from envid %x not timer env\n", envid);
 		return;
 	}
 
-	start = sys_time_msec();
+	start = time_nsec();
 	thread_yield();
-	now = sys_time_msec();
-
-	to = TIMER_INTERVAL - (now - start);
+	to = TIMER_INTERVAL - (time_nsec() - start) / 1000000;
 	ipc_send(envid, to, 0, 0);
 }
 
@@ -253,13 +265,58 @@ serve_thread(uint32_t a) {
 	free(args);
 }
 
+// Hand one request, received into buffer va, to a serve_thread.
+static void
+serve_req(int32_t reqno, uint32_t whom, void *va, int perm)
+{
+	if (debug) {
+		cprintf("ns req %d from %08x\n", reqno, whom);
+	}
+
+	// first take care of requests that do not contain an argument page
+	if (reqno == NSREQ_TIMER) {
+		process_timer(whom);
+		put_buffer(va);
+		return;
+	}
+
+	// All remaining requests must contain an argument page
+	if (!(perm & PTE_P)) {
+		cprintf("Invalid request from %08x: no argument page\n", whom);
+		put_buffer(va);
+		return; // just leave it hanging...
+	}
+
+	// Since some lwIP socket calls will block, create a thread and
+	// process the rest of the request in the thread.
+	struct st_args *args = malloc(sizeof(struct st_args));
+	if (!args)
+		panic("could not allocate thread args structure");
+
+	args->reqno = reqno;
+	args->whom = whom;
+	args->req = va;
+
+	thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
+	thread_yield(); // let the thread created run
+}
+
 void
 serve(void) {
-	int32_t reqno;
-	uint32_t whom;
-	int i, perm;
-	void *va;
-	
+	struct Ipc_msg msgs[NS_BATCH];
+	uint32_t ntraps = 0, nreqs = 0;
+	int i, n, r;
+
+	// Clients block on us, so don't make them wait behind batch jobs.
+	if ((r = sys_env_set_priority(0, ENV_PRIO_MAX)) < 0)
+		panic("sys_env_set_priority: %e", r);
+
+	// Stay on CPU 0 next to the input helper (see input.c), so that
+	// the packets it sends us are handled on the CPU they arrived on
+	// instead of waiting on another CPU's run queue.
+	if ((r = sys_env_set_affinity(0, 1 << 0)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+
 	while (1) {
 		// ipc_recv will block the entire process, so we flush
 		// all pending work from other threads.  We limit the
@@ -267,38 +324,27 @@ serve(void) {
 		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
 			thread_yield();
 
-		perm = 0;
-		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
-		if (debug) {
-			cprintf("ns req %d from %08x\n", reqno, whom);
-		}
-
-		// first take care of requests that do not contain an argument page
-		if (reqno == NSREQ_TIMER) {
-			process_timer(whom);
-			put_buffer(va);
-			continue;
-		}
-
-		// All remaining requests must contain an argument page
-		if (!(perm & PTE_P)) {
-			cprintf("Invalid request from %08x: no argument page\n", whom);
-			continue; // just leave it hanging...
-		}
-
-		// Since some lwIP socket calls will block, create a thread and
-		// process the rest of the request in the thread.
-		struct st_args *args = malloc(sizeof(struct st_args));
-		if (!args)
-			panic("could not allocate thread args structure");
-
-		args->reqno = reqno;
-		args->whom = whom;
-		args->req = va;
-
-		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
-		thread_yield(); // let the thread created run
+		// Take as many queued requests as we have free buffers
+		// for (but at least one) in a single system call.
+		n = MIN(free_buffers(), NS_BATCH);
+		if (n == 0)
+			n = 1;
+		for (i = 0; i < n; i++)
+			msgs[i].im_dstva = get_buffer();
+		if ((r = ipc_recv_batch(msgs, n)) < 0)
+			panic("ipc_recv_batch: %e", r);
+		for (i = r; i < n; i++)
+			put_buffer(msgs[i].im_dstva);
+
+		ntraps++;
+		nreqs += r;
+		if (debug)
+			cprintf("ns: %d reqs, %d.%02d reqs per trap\n", r,
+				nreqs / ntraps, (nreqs * 100 / ntraps) % 100);
+
+		for (i = 0; i < r; i++)
+			serve_req(msgs[i].im_value, msgs[i].im_from,
+				  msgs[i].im_dstva, msgs[i].im_perm);
 	}
 }
 
@@ -2,14 +2,12 @@
 
 void
 timer(envid_t ns_envid, uint32_t initial_to) {
-	uint32_t stop = sys_time_msec() + initial_to;
+	uint32_t stop = time_msec() + initial_to;
 
 	binaryname = "ns_timer";
 
 	while (1) {
-		while(sys_time_msec() < stop) {
-			sys_yield();
-		}
+		sys_sleep_until(stop);
 
 		ipc_send(ns_envid, NSREQ_TIMER, 0, 0);
 
@@ -22,7 +20,7 @@ timer(envid_t ns_envid, uint32_t initial_to) {
 				continue;
 			}
 
-			stop = sys_time_msec() + to;
+			stop = time_msec() + to;
 			break;
 		}
 	}
@@ -0,0 +1,88 @@
+// Stream messages through a channel from a parent to a child, more than
+// a ring holds so that both ends have to sleep, and check that none is
+// lost or reordered.  The parent forks while it has the rings mapped,
+// which must leave them shared, and finally checks that sending fails
+// once the child has gone away.
+
+#include <inc/lib.h>
+
+#define CHANVA		((void *) 0x10000000)
+#define NMSGS		1000
+
+static void
+consumer(void)
+{
+	struct Chan ch;
+	struct Chan_msg msgs[8], m;
+	envid_t parent;
+	uint32_t next = 0;
+	int i, n, r;
+
+	if ((r = chan_attach(ipc_recv(&parent, 0, 0), CHANVA, &ch)) < 0)
+		panic("chan_attach: %e", r);
+	while (next < NMSGS) {
+		if ((n = chan_recv(&ch, msgs, 8)) < 0)
+			panic("chan_recv: %e", n);
+		for (i = 0; i < n; i++, next++)
+			if (msgs[i].cm_type != next)
+				panic("got message %d, expected %d",
+				      msgs[i].cm_type, next);
+	}
+
+	m.cm_type = next;
+	m.cm_len = 0;
+	if ((r = chan_send(&ch, &m)) < 0)
+		panic("chan_send: %e", r);
+}
+
+void
+umain(void)
+{
+	struct Chan ch;
+	struct Chan_msg m;
+	envid_t child;
+	int i, id, r;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		consumer();
+		return;
+	}
+
+	if ((id = chan_create(child, CHANVA, &ch)) < 0)
+		panic("chan_create: %e", id);
+
+	// Children that exit right away, forked both ways with the rings
+	// mapped.  If that made them copy-on-write, our first send would
+	// go to a private copy of the ring that the consumer never sees.
+	if ((r = fork()) < 0)
+		panic("fork: %e", r);
+	if (r == 0)
+		return;
+	if ((r = ufork()) < 0)
+		panic("ufork: %e", r);
+	if (r == 0)
+		return;
+
+	ipc_send(child, id, 0, 0);
+	m.cm_len = 0;
+	for (i = 0; i < NMSGS; i++) {
+		m.cm_type = i;
+		if ((r = chan_send(&ch, &m)) < 0)
+			panic("chan_send: %e", r);
+	}
+	if ((r = chan_recv(&ch, &m, 1)) < 0)
+		panic("chan_recv: %e", r);
+	if (m.cm_type != NMSGS)
+		panic("consumer got %d messages, expected %d", m.cm_type, NMSGS);
+
+	// The consumer exits after its reply, so we must fail once the
+	// ring is full, rather than wait forever.
+	for (i = 0; i <= CHAN_NSLOT; i++)
+		if ((r = chan_send(&ch, &m)) < 0)
+			break;
+	if (r != -E_BAD_ENV)
+		panic("chan_send to a dead consumer returned %e", r);
+	cprintf("chantest: OK\n");
+}
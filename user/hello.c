@@ -5,5 +5,5 @@ void
 umain(void)
 {
 	cprintf("hello, world\n");
-	cprintf("i am environment %08x\n", env->env_id);
+	cprintf("i am environment %08x\n", thisenv->env_id);
 }
@@ -8,23 +8,9 @@ umain(void)
 {
 	binaryname = "idle";
 
-	// Loop forever, simply trying to yield to a different environment.
-	// Instead of busy-waiting like this,
-	// a better way would be to use the processor's HLT instruction
-	// to cause the processor to stop executing until the next interrupt -
-	// doing so allows the processor to conserve power more effectively.
-	while (1) {
+	// The kernel never runs this environment: a CPU with nothing else
+	// to do halts in sched_halt() until an interrupt arrives.  It only
+	// exists to hold envs[0].  Should it ever run, just give up the CPU.
+	while (1)
 		sys_yield();
-
-		// Break into the JOS kernel monitor after each sys_yield().
-		// A real, "production" OS of course would NOT do this -
-		// it would just endlessly loop waiting for hardware interrupts
-		// to cause other environments to become runnable.
-		// However, in JOS it is easier for testing and grading
-		// if we invoke the kernel monitor after each iteration,
-		// because the first invocation of the idle environment
-		// usually means everything else has run to completion.
-		breakpoint();
-	}
 }
-
@@ -0,0 +1,45 @@
+// Ping-pong IPC between two environments and report what a round trip
+// costs in cycles.  Both ends are pinned to CPU 0, so that every IPC is
+// a switch between their two address spaces on the same CPU; compare
+// the numbers on kernels with and without global kernel pages (built
+// with 'make NOPGE=1').
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NWARMUP		100
+#define NROUNDS		10000
+
+void
+umain(void)
+{
+	envid_t who;
+	uint64_t start, cycles;
+	uint32_t i;
+
+	sys_env_set_affinity(0, 1);
+	if ((who = fork()) == 0) {
+		// Child: bounce every value back until told to stop.
+		while ((i = ipc_recv(&who, 0, 0)) != ~0U)
+			ipc_send(who, i, 0, 0);
+		return;
+	}
+	sys_env_set_affinity(who, 1);
+
+	for (i = 0; i < NWARMUP; i++) {
+		ipc_send(who, i, 0, 0);
+		ipc_recv(0, 0, 0);
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NROUNDS; i++) {
+		ipc_send(who, i, 0, 0);
+		ipc_recv(0, 0, 0);
+	}
+	cycles = read_tsc() - start;
+	ipc_send(who, ~0U, 0, 0);
+
+	cprintf("ipcbench: %d round trips in %llu cycles\n", NROUNDS, cycles);
+	cprintf("ipcbench: %llu cycles per round trip, %llu per switch\n",
+		cycles / NROUNDS, cycles / (2 * NROUNDS));
+}
@@ -0,0 +1,65 @@
+// Test timeouts on IPC receives and sleeps.  The child first times out
+// in ipc_recv_until, then gets a message before its deadline, then goes
+// to sleep, and the parent stops it with sys_env_set_status, which must
+// keep the timer from waking it up.
+
+#include <inc/lib.h>
+
+static void
+child(envid_t parent)
+{
+	envid_t from;
+	unsigned int deadline;
+	int r;
+
+	deadline = time_msec() + 100;
+	if ((r = ipc_recv_until(&from, 0, 0, deadline)) != -E_TIMEOUT)
+		panic("ipc_recv_until with no sender returned %d", r);
+	if ((int32_t) (time_msec() - deadline) < 0)
+		panic("ipc_recv_until timed out %d ms early",
+		      deadline - time_msec());
+
+	ipc_send(parent, 1, 0, 0);
+	deadline = time_msec() + 5000;
+	if ((r = ipc_recv_until(&from, 0, 0, deadline)) != 42 || from != parent)
+		panic("ipc_recv_until got %d from %x, not 42 from %x",
+		      r, from, parent);
+	if ((int32_t) (time_msec() - deadline) >= 0)
+		panic("ipc_recv_until returned after its deadline");
+
+	sys_sleep_until(time_msec() + 100);
+	ipc_send(parent, 2, 0, 0);
+}
+
+void
+umain(void)
+{
+	envid_t who, from;
+	int r;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		child(thisenv->env_parent_id);
+		return;
+	}
+
+	if ((r = ipc_recv(&from, 0, 0)) != 1 || from != who)
+		panic("got %d from %x, not 1 from %x", r, from, who);
+	ipc_send(who, 42, 0, 0);
+
+	// Wait for the child to fall asleep, then stop it.  It must not
+	// wake up when its time comes, only once we let it run again.
+	while (envs[ENVX(who)].env_status != ENV_NOT_RUNNABLE)
+		sys_yield();
+	if ((r = sys_env_set_status(who, ENV_NOT_RUNNABLE)) < 0)
+		panic("sys_env_set_status: %e", r);
+	if ((r = ipc_recv_until(&from, 0, 0, time_msec() + 500)) != -E_TIMEOUT)
+		panic("stopped child woke up and sent %d", r);
+	if ((r = sys_env_set_status(who, ENV_RUNNABLE)) < 0)
+		panic("sys_env_set_status: %e", r);
+	if ((r = ipc_recv(&from, 0, 0)) != 2 || from != who)
+		panic("got %d from %x, not 2 from %x", r, from, who);
+
+	cprintf("ipctimeout: OK\n");
+}
@@ -0,0 +1,43 @@
+// Ping-pong a counter between two processes that share memory.
+// Only need to start one of these -- splits into two with sfork.
+// The counter is a global, so each side sees the other's increments,
+// while thisenv, on the stack, stays each side's own.
+
+#include <inc/lib.h>
+
+uint32_t val;
+
+void
+umain(void)
+{
+	envid_t who;
+	uint32_t expect = 0;
+
+	if ((who = sfork()) < 0)
+		panic("sfork: %e", who);
+	if (who != 0) {
+		// get the ball rolling
+		cprintf("send 0 from %x to %x\n", sys_getenvid(), who);
+		ipc_send(who, 0, 0, 0);
+		expect = 1;
+	}
+
+	while (1) {
+		ipc_recv(&who, 0, 0);
+		cprintf("%x got %d from %x (thisenv is %p %x)\n",
+			sys_getenvid(), val, who, thisenv, thisenv->env_id);
+		if (thisenv->env_id != sys_getenvid())
+			panic("thisenv is %x, not %x", thisenv->env_id,
+			      sys_getenvid());
+		if (val != expect)
+			panic("val is %d, not %d: memory is not shared",
+			      val, expect);
+		if (val == 10)
+			return;
+		++val;
+		expect = val + 1;
+		ipc_send(who, 0, 0, 0);
+		if (val == 10)
+			return;
+	}
+}
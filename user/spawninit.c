@@ -4,7 +4,7 @@ void
 umain(void)
 {
 	int r;
-	cprintf("i am parent environment %08x\n", env->env_id);
+	cprintf("i am parent environment %08x\n", thisenv->env_id);
 	if ((r = spawnl("init", "init", "one", "two", 0)) < 0)
 		panic("spawnl(init) failed: %e", r);
 }
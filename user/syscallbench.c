@@ -0,0 +1,49 @@
+// Measure the latency of a null system call, sys_getenvid(), in cycles:
+// once through the library, which uses sysenter where the CPU has it,
+// and once with int $T_SYSCALL.
+
+#include <inc/lib.h>
+#include <inc/syscall.h>
+#include <inc/x86.h>
+
+#define NCALLS		100000
+
+static envid_t
+getenvid_int(void)
+{
+	envid_t ret;
+
+	asm volatile("int %1"
+		: "=a" (ret)
+		: "i" (T_SYSCALL), "a" (SYS_getenvid)
+		: "cc", "memory", "edx", "ecx", "ebx", "edi", "esi");
+	return ret;
+}
+
+void
+umain(void)
+{
+	uint64_t start, lib, trap;
+	int i;
+
+	// Warm up, which also lets the library pick its entry path.
+	for (i = 0; i < 100; i++) {
+		sys_getenvid();
+		getenvid_int();
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		sys_getenvid();
+	lib = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		getenvid_int();
+	trap = read_tsc() - start;
+
+	cprintf("syscallbench: sys_getenvid    %llu cycles per call\n",
+		lib / NCALLS);
+	cprintf("syscallbench: int $T_SYSCALL  %llu cycles per call\n",
+		trap / NCALLS);
+}
@@ -4,9 +4,7 @@
 void
 sleep(int sec)
 {
-	unsigned end = sys_time_msec() + sec * 1000;
-	while (sys_time_msec() < end)
-		sys_yield();
+	sys_sleep_until(time_msec() + sec * 1000);
 }
 
 void